@@ -0,0 +1,225 @@
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+// CPU placement of planning workers and NetHack processes.
+//
+// A game is planned on its home worker (game id % workers) and waits on
+// its NetHack process in between, so the two take turns with the same
+// data. With AFFINITY_CORE worker w and the processes of its games all
+// run on the w-th cpu. With AFFINITY_L2 cpus are grouped by the L2 cache
+// they share, from /sys/devices/system/cpu/cpuN/cache, worker w runs on
+// the first cpu of the w-th group and its games on the rest of it, so
+// the bot and the game are not on one core but still share a cache.
+// Only cpus we are allowed on now are used, and groups and cpus are
+// reused round robin when there are more workers than them.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "nhbot.h"
+
+typedef struct {
+    NhbotAffinity mode;
+    int ngroups;
+    cpu_set_t group[ CPU_SETSIZE ];
+    int nworkers;
+    cpu_set_t *worker;
+    cpu_set_t *games;
+} affinity_t;
+
+// Parse a cpu list such as "0-3,8,10-11"
+static int affinity_parse_list(const char *list, cpu_set_t *set)
+{
+    char *end;
+
+    CPU_ZERO(set);
+    while (*list && *list != '\n') {
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list) {
+            return -1;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list) {
+                return -1;
+            }
+        }
+        for (long c = first; c <= last && c < CPU_SETSIZE; c++) {
+            CPU_SET(c, set);
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+// Format set as a cpu list into buf
+static const char *affinity_format(const cpu_set_t *set, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, set) || (c > 0 && CPU_ISSET(c - 1, set))) {
+            continue;
+        }
+        int last = c;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+            last++;
+        }
+        if (len < size) {
+            len += snprintf(buf + len, size - len, len ? ",%d" : "%d", c);
+        }
+        if (last > c && len < size) {
+            len += snprintf(buf + len, size - len, "-%d", last);
+        }
+    }
+    return buf;
+}
+
+static int affinity_read(const char *path, char *buf, size_t size)
+{
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        return -1;
+    }
+    if (!fgets(buf, (int)size, f)) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+// Cpus sharing an L2 cache with cpu, or just cpu if /sys does not say
+static void affinity_l2_of(int cpu, cpu_set_t *set)
+{
+    char path[128];
+    char buf[1024];
+
+    for (int index = 0; ; index++) {
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+        if (affinity_read(path, buf, sizeof(buf)) == -1) {
+            break;
+        }
+        if (atoi(buf) != 2) {
+            continue;
+        }
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+                 cpu, index);
+        if (affinity_read(path, buf, sizeof(buf)) == 0
+         && affinity_parse_list(buf, set) == 0 && CPU_ISSET(cpu, set)) {
+            return;
+        }
+        break;
+    }
+    CPU_ZERO(set);
+    CPU_SET(cpu, set);
+}
+
+// Choose cpus for nworkers workers, -1 if there are none to choose from
+int affinity_init(affinity_t *a, NhbotAffinity mode, int nworkers)
+{
+    cpu_set_t allowed;
+    cpu_set_t seen;
+
+    memset(a, 0, sizeof(*a));
+    a->mode = mode;
+    a->nworkers = nworkers;
+    if (mode == AFFINITY_NONE) {
+        return 0;
+    }
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0) {
+        return -1;
+    }
+
+    // One group per allowed cpu, or per L2 cache
+    CPU_ZERO(&seen);
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, &allowed) || CPU_ISSET(c, &seen)) {
+            continue;
+        }
+        cpu_set_t *g = &a->group[ a->ngroups++ ];
+        if (mode == AFFINITY_L2) {
+            affinity_l2_of(c, g);
+            CPU_AND(g, g, &allowed);
+        } else {
+            CPU_ZERO(g);
+            CPU_SET(c, g);
+        }
+        CPU_OR(&seen, &seen, g);
+    }
+
+    if (!(a->worker = calloc(nworkers, sizeof(cpu_set_t)))
+     || !(a->games = calloc(nworkers, sizeof(cpu_set_t)))) {
+        free(a->worker);
+        return -1;
+    }
+    for (int w = 0; w < nworkers; w++) {
+        cpu_set_t *g = &a->group[ w % a->ngroups ];
+        int first = 0;
+
+        while (!CPU_ISSET(first, g)) {
+            first++;
+        }
+        CPU_ZERO(&a->worker[ w ]);
+        CPU_SET(first, &a->worker[ w ]);
+        a->games[ w ] = *g;
+        if (CPU_COUNT(g) > 1) {
+            CPU_CLR(first, &a->games[ w ]);
+        }
+    }
+    return 0;
+}
+
+// Pin worker w's thread
+int affinity_pin_worker(const affinity_t *a, int w, pthread_t thread)
+{
+    if (a->mode == AFFINITY_NONE) {
+        return 0;
+    }
+    return pthread_setaffinity_np(thread, sizeof(cpu_set_t), &a->worker[ w ]) == 0 ? 0 : -1;
+}
+
+// Pin the NetHack process of game id
+int affinity_pin_game(const affinity_t *a, int id, pid_t pid)
+{
+    if (a->mode == AFFINITY_NONE || pid <= 0) {
+        return 0;
+    }
+    return sched_setaffinity(pid, sizeof(cpu_set_t), &a->games[ id % a->nworkers ]);
+}
+
+// Print what was chosen
+void affinity_report(const affinity_t *a)
+{
+    char cpus[256];
+    char games[256];
+
+    if (a->mode == AFFINITY_NONE) {
+        return;
+    }
+    fprintf(stderr, "nhbot: affinity %s, %d cpu group%s\n",
+            a->mode == AFFINITY_L2 ? "l2" : "core",
+            a->ngroups, a->ngroups == 1 ? "" : "s");
+    for (int w = 0; w < a->nworkers; w++) {
+        fprintf(stderr, "nhbot:   worker %d on cpu %s, its games on %s\n", w,
+                affinity_format(&a->worker[ w ], cpus, sizeof(cpus)),
+                affinity_format(&a->games[ w ], games, sizeof(games)));
+    }
+}
+
+void affinity_free(affinity_t *a)
+{
+    free(a->worker);
+    free(a->games);
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef _BITBOARD_H_
+#define _BITBOARD_H_
+
+// Bitboards of the map, one 128-bit word per screen row with bit x for
+// column x. A property of every cell (passable, frontier, ...) is one
+// bitboard, and whole-map questions become a few word operations per
+// row, such as one BFS layer of a flood fill.
+
+#include <stdint.h>
+#include <string.h>
+#include "qlearn.h"
+
+__extension__ typedef unsigned __int128 bb_row_t;
+
+#define BB_ROW_MASK ((((bb_row_t)1) << X_MAX) - 1)
+
+typedef struct {
+    bb_row_t row[ Y_MAX ];
+} bitboard_t;
+
+static inline void bb_clear(bitboard_t *b)
+{
+    memset(b, 0, sizeof(*b));
+}
+
+static inline bool bb_test(const bitboard_t *b, int y, int x)
+{
+    return (b->row[ y ] >> x) & 1;
+}
+
+static inline void bb_set(bitboard_t *b, int y, int x)
+{
+    b->row[ y ] |= (bb_row_t)1 << x;
+}
+
+static inline void bb_reset(bitboard_t *b, int y, int x)
+{
+    b->row[ y ] &= ~((bb_row_t)1 << x);
+}
+
+// b and every cell one king move away from it
+void bb_dilate(const bitboard_t *b, bitboard_t *out)
+{
+    bb_row_t h[ Y_MAX ];
+
+    for (int y = 0; y < Y_MAX; y++) {
+        h[ y ] = (b->row[ y ] | (b->row[ y ] << 1) | (b->row[ y ] >> 1))
+               & BB_ROW_MASK;
+    }
+    for (int y = 0; y < Y_MAX; y++) {
+        out->row[ y ] = h[ y ]
+                      | (y > 0 ? h[ y - 1 ] : 0)
+                      | (y < Y_MAX - 1 ? h[ y + 1 ] : 0);
+    }
+}
+
+// One BFS layer: the cells of passable next to reached, not yet reached.
+// reached grows by the layer, false once nothing new is reachable.
+bool bb_expand(bitboard_t *reached, const bitboard_t *passable,
+               bitboard_t *layer)
+{
+    bb_row_t any = 0;
+
+    bb_dilate(reached, layer);
+    for (int y = 0; y < Y_MAX; y++) {
+        layer->row[ y ] &= passable->row[ y ] & ~reached->row[ y ];
+        reached->row[ y ] |= layer->row[ y ];
+        any |= layer->row[ y ];
+    }
+    return any != 0;
+}
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef _BUDGET_H_
+#define _BUDGET_H_
+
+// Planning budget controller.
+//
+// A step is a decision, from the frame being handed to a worker until
+// its move is written, so its latency includes time queued behind other
+// games. The learners are anytime, every plan gets a deadline of
+// budget_ns after it was queued and stops there with the best move so
+// far. Every BUDGET_ADJUST steps the controller takes the p99 latency
+// of the last BUDGET_WINDOW steps and scales the budget by target/p99,
+// damped, so under load plans get shorter instead of moves later. It
+// also keeps NetHack's turn rate, BlStat.T per wall second, summed over
+// games, the throughput that budget is spent on.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BUDGET_WINDOW 512
+#define BUDGET_ADJUST 64
+#define BUDGET_MIN_NS 50000ULL
+
+typedef struct {
+    uint64_t target_ns;
+    uint64_t budget_ns;
+    uint64_t p99_ns;
+    uint32_t latency_us[ BUDGET_WINDOW ];
+    uint64_t steps;
+    uint64_t turns;
+    uint64_t epochs;
+} budget_t;
+
+// Aim for a p99 step latency of target_ns, 0 only measures
+void budget_init(budget_t *b, uint64_t target_ns)
+{
+    *b = (budget_t){ .target_ns = target_ns, .budget_ns = target_ns };
+}
+
+// Deadline of a plan queued at now_ns, 0 for none
+static inline uint64_t budget_deadline(const budget_t *b, uint64_t now_ns)
+{
+    return b->target_ns ? now_ns + b->budget_ns : 0;
+}
+
+static int budget_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// p99 of the latencies in the window
+static uint64_t budget_p99(budget_t *b)
+{
+    uint32_t sorted[ BUDGET_WINDOW ];
+    size_t n = b->steps < BUDGET_WINDOW ? b->steps : BUDGET_WINDOW;
+
+    if (n == 0) {
+        return 0;
+    }
+    memcpy(sorted, b->latency_us, n * sizeof(*sorted));
+    qsort(sorted, n, sizeof(*sorted), budget_cmp);
+    return (uint64_t)sorted[ (n * 99) / 100 ] * 1000;
+}
+
+// A step took latency_ns
+void budget_record(budget_t *b, uint64_t latency_ns)
+{
+    uint64_t us = latency_ns / 1000;
+
+    b->latency_us[ b->steps % BUDGET_WINDOW ] = us > UINT32_MAX ? UINT32_MAX : us;
+    b->steps++;
+    if (b->steps % BUDGET_ADJUST != 0) {
+        return;
+    }
+
+    b->p99_ns = budget_p99(b);
+    if (b->target_ns == 0 || b->p99_ns == 0) {
+        return;
+    }
+
+    // Move a quarter of the way towards the budget that would have met
+    // the target, never past it and never to nothing
+    double scale = (double)b->target_ns / (double)b->p99_ns;
+    double next = (double)b->budget_ns * (0.75 + 0.25 * scale);
+    if (next > (double)b->target_ns) {
+        next = (double)b->target_ns;
+    }
+    if (next < (double)BUDGET_MIN_NS) {
+        next = (double)BUDGET_MIN_NS;
+    }
+    b->budget_ns = (uint64_t)next;
+}
+
+// Game turns passed, for the turn rate
+static inline void budget_turns(budget_t *b, uint64_t turns)
+{
+    b->turns += turns;
+}
+
+#endif
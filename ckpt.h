@@ -0,0 +1,205 @@
+#ifndef _CKPT_H_
+#define _CKPT_H_
+
+// Learner checkpoints.
+//
+// A checkpoint is a header followed by page aligned sections holding the
+// raw learner tables exactly as they sit in memory. Loading is an mmap
+// with MAP_PRIVATE, the learners point straight into the mapping and
+// copy-on-write keeps their updates out of the file. Saving writes a
+// new file next to the old one and renames it over, so a crash never
+// leaves a torn checkpoint.
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "qlearn.h"
+#include "qmap.h"
+#include "qshare.h"
+
+#define CKPT_MAGIC    0x5142484eU  // "NHBQ"
+#define CKPT_VERSION  1
+#define CKPT_ALIGN    4096
+
+typedef enum {
+    CKPT_GRID = 1,   // qlearn_t stateSpace of one game
+    CKPT_QMAP,       // qmap_t table of one game
+    CKPT_QSHARE,     // entries of the shared table
+} CkptKind;
+
+typedef struct {
+    uint32_t kind;
+    uint32_t id;
+    uint64_t offset;
+    uint64_t size;
+} ckpt_section_t;
+
+// Geometry is stored so a build with different table shapes refuses
+// the file instead of misreading it
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t y_max;
+    uint32_t x_max;
+    uint32_t actions;
+    uint32_t qmap_states;
+    uint32_t qshare_slots;
+    uint32_t nsections;
+    uint64_t created;
+    ckpt_section_t sections[];
+} ckpt_header_t;
+
+typedef struct {
+    CkptKind kind;
+    uint32_t id;
+    const void *data;
+    uint64_t size;
+} ckpt_blob_t;
+
+typedef struct {
+    void *map;
+    size_t size;
+    const ckpt_header_t *header;
+} ckpt_map_t;
+
+static inline uint64_t ckpt_align(uint64_t n)
+{
+    return (n + CKPT_ALIGN - 1) & ~(uint64_t)(CKPT_ALIGN - 1);
+}
+
+static void ckpt_fill_header(ckpt_header_t *h, uint32_t nsections)
+{
+    h->magic = CKPT_MAGIC;
+    h->version = CKPT_VERSION;
+    h->y_max = Y_MAX;
+    h->x_max = X_MAX;
+    h->actions = MAX_ACTIONS;
+    h->qmap_states = QMAP_STATES;
+    h->qshare_slots = QSHARE_SHARDS * QSHARE_SHARD_SLOTS;
+    h->nsections = nsections;
+    h->created = (uint64_t)time(NULL);
+}
+
+// Map a checkpoint copy-on-write, -1 if missing or not ours
+int ckpt_map(ckpt_map_t *m, const char *path)
+{
+    struct stat st;
+    ckpt_header_t expect;
+    const ckpt_header_t *h;
+    int fd;
+
+    *m = (ckpt_map_t){0};
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ckpt_header_t)) {
+        close(fd);
+        return -1;
+    }
+
+    m->size = st.st_size;
+    m->map = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m->map == MAP_FAILED) {
+        m->map = NULL;
+        return -1;
+    }
+
+    h = m->header = m->map;
+    ckpt_fill_header(&expect, h->nsections);
+    if (memcmp(h, &expect, offsetof(ckpt_header_t, created)) != 0
+     || sizeof(ckpt_header_t) + h->nsections * sizeof(ckpt_section_t) > m->size) {
+        fprintf(stderr, "nhbot: %s: incompatible checkpoint, ignored\n", path);
+        munmap(m->map, m->size);
+        *m = (ckpt_map_t){0};
+        return -1;
+    }
+
+    return 0;
+}
+
+// Section data inside the mapping, NULL if absent or the wrong size
+void *ckpt_find(ckpt_map_t *m, CkptKind kind, uint32_t id, uint64_t size)
+{
+    if (!m->header) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < m->header->nsections; i++) {
+        const ckpt_section_t *s = &m->header->sections[i];
+        if (s->kind == kind && s->id == id && s->size == size
+         && s->offset % CKPT_ALIGN == 0 && s->offset + s->size <= m->size) {
+            return (uint8_t *)m->map + s->offset;
+        }
+    }
+    return NULL;
+}
+
+static int ckpt_write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Write blobs to path.tmp, sync it, then rename it over path
+int ckpt_save(const char *path, const ckpt_blob_t *blobs, uint32_t n)
+{
+    static const uint8_t zero[CKPT_ALIGN];
+    char tmp[4096];
+    ckpt_header_t *h = NULL;
+    size_t hsize = sizeof(ckpt_header_t) + n * sizeof(ckpt_section_t);
+    uint64_t offset = ckpt_align(hsize);
+    int fd = -1;
+
+    check(snprintf(tmp, sizeof(tmp), "%s.tmp", path) < (int)sizeof(tmp));
+    check((h = calloc(1, ckpt_align(hsize))));
+    ckpt_fill_header(h, n);
+    for (uint32_t i = 0; i < n; i++) {
+        h->sections[i].kind = blobs[i].kind;
+        h->sections[i].id = blobs[i].id;
+        h->sections[i].offset = offset;
+        h->sections[i].size = blobs[i].size;
+        offset += ckpt_align(blobs[i].size);
+    }
+
+    check((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) != -1);
+    check(ckpt_write_all(fd, h, ckpt_align(hsize)) != -1);
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t pad = ckpt_align(blobs[i].size) - blobs[i].size;
+        check(ckpt_write_all(fd, blobs[i].data, blobs[i].size) != -1);
+        check(ckpt_write_all(fd, zero, pad) != -1);
+    }
+    check(fsync(fd) != -1);
+    check(close(fd) != -1);
+    fd = -1;
+    check(rename(tmp, path) != -1);
+
+    free(h);
+    return 0;
+
+error:
+    if (fd != -1) {
+        close(fd);
+        unlink(tmp);
+    }
+    free(h);
+    return -1;
+}
+
+#endif
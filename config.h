@@ -0,0 +1,160 @@
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+// Learner settings from the command line and config files.
+//
+// Both take key=value pairs naming a field of qlearnConfig, a file has
+// one per line and # starts a comment. Later settings win.
+//
+//   learning_rate  alpha, 0 < x <= 1
+//   discount       gamma, 0 <= x <= 1
+//   epochs         simulated moves per plan of the grid learner
+//   qmap_epochs    simulated moves per plan of the qmap learner
+//   actions        4 (orthogonal moves only) to 8
+//   policy         greedy, egreedy or softmax
+//   epsilon        egreedy: starting chance of a random move
+//   epsilon_decay  egreedy: epsilon is multiplied by this every move
+//   epsilon_min    egreedy: epsilon never decays below this
+//   temperature    softmax: lower is greedier
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qlearn.h"
+
+static bool config_number(const char *value, double min, double max,
+                          double *out)
+{
+    char *end;
+    double v = strtod(value, &end);
+
+    if (end == value || *end != '\0' || v < min || v > max) {
+        return false;
+    }
+    *out = v;
+    return true;
+}
+
+static bool config_int(const char *value, int min, int max, int *out)
+{
+    char *end;
+    long v = strtol(value, &end, 10);
+
+    if (end == value || *end != '\0' || v < min || v > max) {
+        return false;
+    }
+    *out = (int)v;
+    return true;
+}
+
+// Apply one setting, -1 with a message if it is unknown or out of range
+int config_set(const char *key, const char *value)
+{
+    qlearnConfig_t *c = &qlearnConfig;
+    bool ok = false;
+
+    if (strcmp(key, "learning_rate") == 0) {
+        ok = config_number(value, 1e-9, 1.0, &c->learningRate);
+    } else if (strcmp(key, "discount") == 0) {
+        ok = config_number(value, 0.0, 1.0, &c->discountRate);
+    } else if (strcmp(key, "epochs") == 0) {
+        ok = config_int(value, 0, 1000000000, &c->epochs);
+    } else if (strcmp(key, "qmap_epochs") == 0) {
+        ok = config_int(value, 0, 1000000000, &c->qmapEpochs);
+    } else if (strcmp(key, "actions") == 0) {
+        ok = config_int(value, 4, MAX_ACTIONS, &c->actions);
+    } else if (strcmp(key, "policy") == 0) {
+        ok = true;
+        if (strcmp(value, "greedy") == 0) {
+            c->policy = POLICY_GREEDY;
+        } else if (strcmp(value, "egreedy") == 0) {
+            c->policy = POLICY_EGREEDY;
+        } else if (strcmp(value, "softmax") == 0) {
+            c->policy = POLICY_SOFTMAX;
+        } else {
+            ok = false;
+        }
+    } else if (strcmp(key, "epsilon") == 0) {
+        ok = config_number(value, 0.0, 1.0, &c->epsilon);
+    } else if (strcmp(key, "epsilon_decay") == 0) {
+        ok = config_number(value, 1e-9, 1.0, &c->epsilonDecay);
+    } else if (strcmp(key, "epsilon_min") == 0) {
+        ok = config_number(value, 0.0, 1.0, &c->epsilonMin);
+    } else if (strcmp(key, "temperature") == 0) {
+        ok = config_number(value, 0.0, 1e9, &c->temperature);
+    } else {
+        fprintf(stderr, "nhbot: unknown setting %s\n", key);
+        return -1;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "nhbot: bad value for %s: %s\n", key, value);
+        return -1;
+    }
+    return 0;
+}
+
+static char *config_trim(char *s)
+{
+    char *end;
+
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+// Apply a "key=value" argument
+int config_arg(const char *arg)
+{
+    char buf[256];
+    char *eq;
+
+    if (snprintf(buf, sizeof(buf), "%s", arg) >= (int)sizeof(buf)
+     || !(eq = strchr(buf, '='))) {
+        fprintf(stderr, "nhbot: expected key=value, got %s\n", arg);
+        return -1;
+    }
+    *eq = '\0';
+    return config_set(config_trim(buf), config_trim(eq + 1));
+}
+
+// Apply every setting in a file
+int config_load(const char *path)
+{
+    char line[256];
+    int lineno = 0;
+    FILE *f;
+
+    if (!(f = fopen(path, "r"))) {
+        fprintf(stderr, "nhbot: cannot open %s\n", path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *s = line;
+        char *hash = strchr(s, '#');
+
+        lineno++;
+        if (hash) {
+            *hash = '\0';
+        }
+        s = config_trim(s);
+        if (*s == '\0') {
+            continue;
+        }
+        if (config_arg(s) == -1) {
+            fprintf(stderr, "nhbot: %s:%d\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+#endif
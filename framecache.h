@@ -0,0 +1,138 @@
+#ifndef _FRAMECACHE_H_
+#define _FRAMECACHE_H_
+
+// Frame hashes and the decision cache.
+//
+// Every screen row has a 64-bit hash of its characters and colors,
+// recomputed only when the row is redrawn, and the frame hash is the
+// xor of the row hashes, so a redraw of one row costs one row. The hash
+// of a row depends on its index, moving a row changes the frame.
+//
+// A frame that repeats exactly, the same position after a move that
+// failed or the same prompt, was planned before. The decision cache
+// maps frame hashes to the Q-values and legal moves planned on them, a
+// set-associative LRU of FRAMECACHE_SETS sets of FRAMECACHE_WAYS, and
+// a hit picks from them with the policy again instead of replaying one
+// move.
+
+#include <stdint.h>
+#include <string.h>
+#include "qlearn.h"
+
+#define FRAMECACHE_SETS 256
+#define FRAMECACHE_WAYS 4
+
+static inline uint64_t frame_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Hash of n cells of screen row row
+static inline uint64_t frame_hash_row(const uint8_t *chars,
+                                      const uint8_t *colors, int n, int row)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL * (uint64_t)(row + 1);
+    uint64_t a;
+    uint64_t b;
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        memcpy(&a, chars + i, 8);
+        memcpy(&b, colors + i, 8);
+        h = (h ^ a) * 0x100000001b3ULL;
+        h = ((h << 29) | (h >> 35)) ^ b;
+    }
+    for (; i < n; i++) {
+        h = (h ^ (chars[i] | (uint64_t)colors[i] << 8)) * 0x100000001b3ULL;
+    }
+    return frame_mix(h ^ (uint64_t)n);
+}
+
+typedef struct {
+    uint64_t key;
+    uint32_t stamp;
+    uint32_t legal;
+    float QVal[ MAX_ACTIONS ];
+} framecache_entry_t;
+
+typedef struct framecache {
+    framecache_entry_t set[ FRAMECACHE_SETS ][ FRAMECACHE_WAYS ];
+    uint32_t clock;
+    uint64_t hits;
+    uint64_t misses;
+} framecache_t;
+
+static inline framecache_entry_t *framecache_set(framecache_t *fc, uint64_t key)
+{
+    return fc->set[ (key >> 32) % FRAMECACHE_SETS ];
+}
+
+// The Q-values and legal moves (bit a for action a) planned on frame
+// key, false if there are none. Key 0 is never cached, it is an empty
+// entry.
+bool framecache_get(framecache_t *fc, uint64_t key,
+                    double QVal[ MAX_ACTIONS ], unsigned *legal)
+{
+    framecache_entry_t *set = framecache_set(fc, key);
+
+    for (int w = 0; key && w < FRAMECACHE_WAYS; w++) {
+        if (set[ w ].key == key) {
+            set[ w ].stamp = ++fc->clock;
+            for (int a = 0; a < MAX_ACTIONS; a++) {
+                QVal[ a ] = set[ w ].QVal[ a ];
+            }
+            *legal = set[ w ].legal;
+            fc->hits++;
+            return true;
+        }
+    }
+    fc->misses++;
+    return false;
+}
+
+// Remember what was planned on frame key, evicting the least recently
+// used entry of its set
+void framecache_put(framecache_t *fc, uint64_t key,
+                    const double QVal[ MAX_ACTIONS ], unsigned legal)
+{
+    framecache_entry_t *set = framecache_set(fc, key);
+    framecache_entry_t *victim = &set[ 0 ];
+
+    if (!key) {
+        return;
+    }
+    for (int w = 0; w < FRAMECACHE_WAYS; w++) {
+        if (set[ w ].key == key) {
+            victim = &set[ w ];
+            break;
+        }
+        if (set[ w ].stamp < victim->stamp) {
+            victim = &set[ w ];
+        }
+    }
+    victim->key = key;
+    victim->stamp = ++fc->clock;
+    victim->legal = legal;
+    for (int a = 0; a < MAX_ACTIONS; a++) {
+        victim->QVal[ a ] = (float)QVal[ a ];
+    }
+}
+
+// Forget frame key
+void framecache_drop(framecache_t *fc, uint64_t key)
+{
+    framecache_entry_t *set = framecache_set(fc, key);
+
+    for (int w = 0; w < FRAMECACHE_WAYS; w++) {
+        if (set[ w ].key == key) {
+            set[ w ] = (framecache_entry_t){0};
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef _LEVELMAP_H_
+#define _LEVELMAP_H_
+
+// Per-level map memory.
+//
+// Every dungeon level, keyed by BlStat.Dlvl, remembers the tile class of
+// every map cell it has seen, so a level that is revisited or partly
+// hidden by the message line is not forgotten. The frontier is every
+// seen, passable cell next to one never seen that the player has not
+// stood on yet. Only cells that changed since they were last seen,
+// and their neighbours, are reclassified. Passable and frontier cells
+// are mirrored in bitboards for the frontier search.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitboard.h"
+#include "qlearn.h"
+
+#define LEVELMAP_LEVELS 64
+
+// Screen rows of the map, below the message line and above the status
+#define LEVELMAP_TOP    1
+#define LEVELMAP_BOTTOM (Y_MAX - 2)
+
+#define LEVELMAP_UNSEEN   0xff
+#define LEVELMAP_VISITED  0x01
+#define LEVELMAP_FRONTIER 0x02
+
+typedef struct {
+    uint8_t chars[ Y_MAX ][ X_MAX ];
+    uint8_t tiles[ Y_MAX ][ X_MAX ];
+    uint8_t flags[ Y_MAX ][ X_MAX ];
+    int nfrontier;
+    bitboard_t passable;
+    bitboard_t frontier;
+} levelmap_level_t;
+
+typedef struct levelmap {
+    levelmap_level_t *levels[ LEVELMAP_LEVELS ];
+    levelmap_level_t *level;
+    uint32_t dlvl;
+    uint64_t pending;
+} levelmap_t;
+
+static inline bool levelmap_on_map(int y, int x)
+{
+    return y >= LEVELMAP_TOP && y < LEVELMAP_BOTTOM && x >= 0 && x < X_MAX;
+}
+
+static inline bool levelmap_passable(levelmap_level_t *l, int y, int x)
+{
+    return l->tiles[ y ][ x ] != LEVELMAP_UNSEEN
+        && l->tiles[ y ][ x ] != TILE_WALL;
+}
+
+// Recompute whether a cell is on the frontier
+static void levelmap_classify(levelmap_level_t *l, int y, int x)
+{
+    bool frontier = false;
+
+    if (levelmap_passable(l, y, x) && !(l->flags[ y ][ x ] & LEVELMAP_VISITED)) {
+        for (int a = 0; a < MAX_ACTIONS && !frontier; a++) {
+            int ny = y + dir[ a ].y;
+            int nx = x + dir[ a ].x;
+            frontier = levelmap_on_map(ny, nx)
+                    && l->tiles[ ny ][ nx ] == LEVELMAP_UNSEEN;
+        }
+    }
+
+    if (frontier != !!(l->flags[ y ][ x ] & LEVELMAP_FRONTIER)) {
+        l->flags[ y ][ x ] ^= LEVELMAP_FRONTIER;
+        l->nfrontier += frontier ? 1 : -1;
+        if (frontier) {
+            bb_set(&l->frontier, y, x);
+        } else {
+            bb_reset(&l->frontier, y, x);
+        }
+    }
+}
+
+// Reclassify a cell and its neighbours
+static void levelmap_touch(levelmap_level_t *l, int y, int x)
+{
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            if (levelmap_on_map(y + dy, x + dx)) {
+                levelmap_classify(l, y + dy, x + dx);
+            }
+        }
+    }
+}
+
+// Forget every level, a new game started
+void levelmap_reset(levelmap_t *lm)
+{
+    for (int i = 0; i < LEVELMAP_LEVELS; i++) {
+        free(lm->levels[ i ]);
+    }
+    *lm = (levelmap_t){0};
+}
+
+// Fold the changed rows of the screen into the current level
+void levelmap_update(levelmap_t *lm, NetHackState *nethack_state, uint64_t rows)
+{
+    uint32_t dlvl = nethack_state->BlStat.Dlvl;
+    int row = nethack_state->PlayerRow;
+    int col = nethack_state->PlayerCol;
+    levelmap_level_t *l;
+
+    // Without a player or a level, keep the rows for later
+    lm->pending |= rows;
+    if (dlvl == 0 || dlvl >= LEVELMAP_LEVELS || row == -1) {
+        return;
+    }
+
+    // On a new level the whole screen belongs to it
+    if (dlvl != lm->dlvl) {
+        if (!(l = lm->levels[ dlvl ])) {
+            if (!(l = malloc(sizeof(levelmap_level_t)))) {
+                return;
+            }
+            memset(l->chars, 0, sizeof(l->chars));
+            memset(l->tiles, LEVELMAP_UNSEEN, sizeof(l->tiles));
+            memset(l->flags, 0, sizeof(l->flags));
+            l->nfrontier = 0;
+            bb_clear(&l->passable);
+            bb_clear(&l->frontier);
+            lm->levels[ dlvl ] = l;
+        }
+        lm->level = l;
+        lm->dlvl = dlvl;
+        lm->pending = ~0ULL;
+    }
+    l = lm->level;
+    rows = lm->pending;
+    lm->pending = 0;
+
+    for (int y = LEVELMAP_TOP; y < LEVELMAP_BOTTOM; y++) {
+        if (!(rows & (1ULL << y))) {
+            continue;
+        }
+        for (int x = 0; x < X_MAX; x++) {
+            uint8_t ch = nethack_state->ScreenChar[ screen_index(nethack_state, y, x) ];
+            // Blank is not shown right now, not necessarily unseen
+            if (ch == ' ' || ch == '\0' || ch == l->chars[ y ][ x ]) {
+                continue;
+            }
+            l->chars[ y ][ x ] = ch;
+            l->tiles[ y ][ x ] = getTileClass(nethack_state, x, y);
+            if (levelmap_passable(l, y, x)) {
+                bb_set(&l->passable, y, x);
+            } else {
+                bb_reset(&l->passable, y, x);
+            }
+            levelmap_touch(l, y, x);
+        }
+    }
+
+    // Rock next to a walked cell stays unseen, do not go back for it
+    if (levelmap_on_map(row, col) && !(l->flags[ row ][ col ] & LEVELMAP_VISITED)) {
+        l->flags[ row ][ col ] |= LEVELMAP_VISITED;
+        levelmap_classify(l, row, col);
+    }
+}
+
+// First move of a shortest remembered path to the nearest frontier
+// cell, -1 if there is none. The search grows BFS layers out of the
+// whole frontier at once until one reaches a neighbour of the player.
+int levelmap_frontier_step(levelmap_t *lm, int row, int col)
+{
+    levelmap_level_t *l = lm->level;
+    bitboard_t reached;
+    bitboard_t layer;
+
+    if (!l || l->nfrontier == 0 || !levelmap_on_map(row, col)) {
+        return -1;
+    }
+
+    reached = l->frontier;
+    bb_reset(&reached, row, col);
+    do {
+        for (int a = 0; a < MAX_ACTIONS; a++) {
+            int y = row + dir[ a ].y;
+            int x = col + dir[ a ].x;
+            if (levelmap_on_map(y, x) && bb_test(&reached, y, x)) {
+                return a;
+            }
+        }
+    } while (bb_expand(&reached, &l->passable, &layer));
+    return -1;
+}
+
+#endif
@@ -1,33 +1,290 @@
-#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
 #include <ctype.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <pty.h>
 #include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "nhbot.h"
+#include "affinity.h"
+#include "budget.h"
+#include "ckpt.h"
+#include "config.h"
+#include "framecache.h"
+#include "levelmap.h"
+#include "playground.h"
 #include "qlearn.h"
+#include "qbatch.h"
+#include "qmap.h"
+#include "qshare.h"
+#include "reward.h"
+#include "sched.h"
+#include "stream.h"
 #include "tmt.h"
+#include "traj.h"
+#include "uring.h"
+
+// NetHack games, the ngames being played come first and are followed
+// by nspares pre-started ones that replace a game when it ends
+struct io_params *games;
+int ngames;
+int nspares;
+
+// Launch NetHack with fork() instead of posix_spawn()
+bool spawn_with_fork;
+
+// Terminal size of every game. A wider one fits more messages on the
+// top line before NetHack stops at --More--.
+int vt_cols = VT_W;
+int vt_rows = VT_H;
+
+#ifdef TMT_FIXED
+// The terminals of every slot, side by side in one block
+unsigned char *vt_arena;
+size_t vt_size;
+#endif
+
+// Decide for the qmap learner on the io loop, every game that is ready
+// in one qbatch, instead of one worker task per game. The decisions are
+// those of -o qmap_epochs=0.
+bool batch_policy;
+qbatch_t batch;
+struct io_params *batch_games[ QBATCH_MAX ];
+
+// Pty I/O through io_uring instead of select(), and the I/O system
+// calls made by either
+uring_t uring;
+bool use_uring;
+uint64_t io_syscalls;
+
+// Cpus of the workers and of every game's NetHack
+affinity_t affinity;
+
+// Planning time per decision, adjusted to keep the p99 step latency
+// on target
+budget_t budget;
+
+// Most moves the grid learner sends ahead of the screen, 0 waits for
+// every frame
+int speculate;
+
+// How long a key may go unanswered, and how many decisions to wait
+// before trying to eat or drop again when there was no menu
+#define NHBOT_KEY_TIMEOUT_NS 50000000ULL
+#define NHBOT_RETRY_DECISIONS 100
+
+// Decisions on the same frame, out of the last NHBOT_RECENT, that make
+// a game stuck
+#define NHBOT_STUCK_REPEATS 3
+
+// Frames a speculating game may draw without the player moving, and
+// how long it may take altogether
+#define SPEC_IDLE_MAX 4
+#define SPEC_TIMEOUT_NS 250000000ULL
+
+static uint64_t nhbot_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Launch latency
+uint64_t spawn_count;
+uint64_t spawn_ns_total;
+uint64_t spawn_ns_max;
+
+// Finished games
+uint64_t episodes;
+
+// Planning workers
+sched_t sched;
+
+// Q-values shared across games, NULL unless enabled
+qshare_t *qshare;
+
+// Written by a worker when a plan is ready, wakes the io loop
+int wake_pipe[2] = {-1, -1};
+
+// When the io loop started
+struct timespec start_time;
+
+// Render rate of game 0 on stdout, 0 unthrottled, -1 headless
+int spectator_fps;
+
+// Frame deltas for viewers on a Unix socket
+stream_t stream;
+bool streaming;
+
+// Decisions recorded for offline training
+traj_log_t traj;
+bool trajectories;
+
+// Set by SIGINT/SIGTERM, the io loop exits and we shut down
+volatile sig_atomic_t nhbot_stopping;
+
+// Set by SIGCHLD, the io loop reaps and restarts games
+volatile sig_atomic_t nhbot_child_exited;
 
-// NetHack pid
-pid_t pid;
+// Learner checkpoint we started from, and where to save new ones
+ckpt_map_t checkpoint;
+const char *checkpoint_path;
+int checkpoint_interval;
+struct timespec checkpoint_time;
 
-// NetHack stdin
-int master_write_fd;
+// Print throughput counters
+static void nhbot_report(void)
+{
+    struct timespec now;
+    uint64_t decisions = 0;
+    uint64_t spec_sent = 0;
+    uint64_t spec_aborts = 0;
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t stuck = 0;
+    uint64_t epochs = 0;
+    struct rusage ru;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (double)(now.tv_sec - start_time.tv_sec)
+                   + (double)(now.tv_nsec - start_time.tv_nsec) / 1e9;
+
+    for (int i = 0; i < ngames; i++) {
+        decisions += games[i].decisions;
+        spec_sent += games[i].spec_sent;
+        spec_aborts += games[i].spec_aborts;
+        cache_hits += games[i].framecache->hits;
+        cache_misses += games[i].framecache->misses;
+        stuck += games[i].stuck;
+        epochs += games[i].epochs;
+    }
+    fprintf(stderr, "nhbot: %d games, %d workers, %llu decisions, "
+            "%.1f decisions/s, %llu steals, %llu episodes\n", ngames,
+            sched.nworkers, (unsigned long long)decisions,
+            elapsed > 0 ? (double)decisions / elapsed : 0.0,
+            (unsigned long long)sched.steals, (unsigned long long)episodes);
+    fprintf(stderr, "nhbot: %llu of %llu plans from the frame cache, "
+            "%llu stuck frames\n", (unsigned long long)cache_hits,
+            (unsigned long long)(cache_hits + cache_misses),
+            (unsigned long long)stuck);
+    fprintf(stderr, "nhbot: p99 step latency %.2f ms", (double)budget.p99_ns / 1e6);
+    if (budget.target_ns) {
+        fprintf(stderr, " (target %.2f ms, budget %.2f ms)",
+                (double)budget.target_ns / 1e6, (double)budget.budget_ns / 1e6);
+    }
+    fprintf(stderr, ", %.0f epochs/decision, %.1f turns/s\n",
+            decisions ? (double)epochs / decisions : 0.0,
+            elapsed > 0 ? (double)budget.turns / elapsed : 0.0);
+    getrusage(RUSAGE_SELF, &ru);
+    double cpu = (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)
+               + (double)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+    fprintf(stderr, "nhbot: io %s, %.2f syscalls/decision, %.3f ms cpu/decision, "
+            "%.2f%% cpu/game\n",
+            use_uring ? (uring.multishot ? "io_uring multishot" : "io_uring") : "select",
+            decisions ? (double)(io_syscalls + uring.enters) / decisions : 0.0,
+            decisions ? cpu * 1e3 / decisions : 0.0,
+            elapsed > 0 ? cpu * 100.0 / elapsed / ngames : 0.0);
+    if (uring.write_retries) {
+        fprintf(stderr, "nhbot: %llu io_uring writes finished by write(2), "
+                "%llu failed\n", (unsigned long long)uring.write_retries,
+                (unsigned long long)uring.write_errors);
+    }
+    if (spec_sent) {
+        fprintf(stderr, "nhbot: %llu moves sent ahead, %llu speculations "
+                "stopped early\n", (unsigned long long)spec_sent,
+                (unsigned long long)spec_aborts);
+    }
+    if (spawn_count) {
+        fprintf(stderr, "nhbot: %llu launches (%s), %.1f us avg, %.1f us max\n",
+                (unsigned long long)spawn_count,
+                spawn_with_fork ? "fork" : "posix_spawn",
+                (double)spawn_ns_total / spawn_count / 1e3,
+                (double)spawn_ns_max / 1e3);
+    }
+    if (qshare) {
+        fprintf(stderr, "nhbot: %llu shared patterns, %llu dropped updates\n",
+                (unsigned long long)qshare_size(qshare),
+                (unsigned long long)qshare->dropped);
+    }
+    if (trajectories) {
+        fprintf(stderr, "nhbot: %llu trajectory records, %llu dropped\n",
+                (unsigned long long)traj.written,
+                (unsigned long long)traj.dropped);
+    }
+}
 
-// NetHack state
-NetHackState nethack_state = {0};
+// Snapshot every learner table, workers must be idle
+static void nhbot_checkpoint(void)
+{
+    uint32_t n = 0;
+    ckpt_blob_t *blobs;
+
+    if (!checkpoint_path) {
+        return;
+    }
+    sched_wait_idle(&sched);
+
+    check((blobs = calloc(ngames + 1, sizeof(ckpt_blob_t))));
+    for (int i = 0; i < ngames; i++) {
+        if (games[i].learner) {
+            blobs[n++] = (ckpt_blob_t){ CKPT_GRID, i,
+                games[i].learner->stateSpace, QLEARN_TABLE_SIZE };
+        } else if (games[i].qmap) {
+            blobs[n++] = (ckpt_blob_t){ CKPT_QMAP, i,
+                games[i].qmap->QVal, QMAP_TABLE_SIZE };
+        }
+    }
+    if (qshare) {
+        blobs[n++] = (ckpt_blob_t){ CKPT_QSHARE, 0,
+            qshare->entries, QSHARE_TABLE_SIZE };
+    }
+    if (ckpt_save(checkpoint_path, blobs, n) == -1) {
+        fprintf(stderr, "nhbot: checkpoint %s failed\n", checkpoint_path);
+    }
+    free(blobs);
+
+error:
+    clock_gettime(CLOCK_MONOTONIC, &checkpoint_time);
+}
+
+// Learner table from the checkpoint, or a fresh zeroed one
+static void *nhbot_table(CkptKind kind, uint32_t id, uint64_t size)
+{
+    void *table = ckpt_find(&checkpoint, kind, id, size);
+    return table ? table : calloc(1, size);
+}
 
 // Kill NetHack
 static void nhbot_shutdown(void)
 {
-    kill(pid, SIGTERM);
+    if (games) {
+        nhbot_checkpoint();
+    }
+    for (int i = 0; i < ngames + nspares; i++) {
+        if (games[i].pid > 0) {
+            kill(games[i].pid, SIGTERM);
+        }
+    }
+    if (trajectories) {
+        traj_close(&traj);
+    }
+    if (games) {
+        nhbot_report();
+    }
+    if (streaming) {
+        stream_close(&stream);
+    }
     exit(0);
 }
 
@@ -39,7 +296,10 @@ static void handle_signal(int signum)
         break;
     case SIGINT:
     case SIGTERM:
-        nhbot_shutdown();
+        nhbot_stopping = 1;
+        break;
+    case SIGCHLD:
+        nhbot_child_exited = 1;
         break;
     default:
         fprintf(stderr, "unhandled signal: %d", signum);
@@ -53,17 +313,30 @@ static inline int randrange (int lower, int upper)
     return (rand() % (upper - lower + 1)) + lower;
 }
 
-// Write a char to NetHack stdin
+// Write a char to NetHack stdin. With io_uring it is queued and goes
+// out with the next wait for output.
 static ssize_t nhbot_write(int fd, uint8_t *c, size_t len)
 {
     ssize_t nread;
     fd_set writeable;
     ssize_t result = -1;
 
+    if (use_uring && uring_write(&uring, fd, c, len) == (ssize_t)len) {
+        return len;
+    }
+
+    // Only io_uring runs past FD_SETSIZE, and its ptys do not block
+    if (fd >= FD_SETSIZE) {
+        io_syscalls++;
+        check((result = write(fd, c, len)) == (ssize_t)len);
+        return result;
+    }
+
     int maxfd = fd;
     FD_ZERO(&writeable);
     FD_SET(fd, &writeable);
     struct timeval tv = {0, 100};
+    io_syscalls += 2;
     if (select(maxfd + 1, NULL, &writeable, NULL, &tv) == -1) {
         fprintf(stderr, "select():%s:%d ", __FILE__, __LINE__);
         return result;
@@ -80,11 +353,53 @@ error:
     return result;
 }
 
-// Write the ascii (ansi stripped) NetHack screen to stdout
+// Write the ascii (ansi stripped) NetHack screen to stdout, one line
+// per row. On a terminal the cursor is homed first so it repaints.
 static int write_output(NetHackState *nethack_state)
 {
-    return write(STDOUT_FILENO, nethack_state->ScreenChar,
-                 VT_W*VT_H*sizeof(uint8_t));
+    static char out[sizeof("\033[H") + VT_H_MAX * (VT_W_MAX + 1)];
+    static int tty = -1;
+    size_t len = 0;
+
+    if (tty == -1) {
+        tty = isatty(STDOUT_FILENO);
+    }
+    if (tty) {
+        memcpy(out, "\033[H", 3);
+        len = 3;
+    }
+    for (int r = 0; r < nethack_state->Rows; r++) {
+        for (int c = 0; c < nethack_state->Cols; c++) {
+            uint8_t ch = nethack_state->ScreenChar[screen_index(nethack_state, r, c)];
+            out[len++] = ch ? ch : ' ';
+        }
+        out[len++] = '\n';
+    }
+    return write(STDOUT_FILENO, out, len);
+}
+
+// Render game 0 at most spectator_fps times a second, and only when its
+// screen changed since the last render
+static void spectator_render(const struct timespec *now)
+{
+    static struct timespec last_render;
+    static uint32_t last_frame;
+    NetHackState *nethack_state = games[0].nethack_state;
+
+    if (spectator_fps < 0 || nethack_state->FrameCount == last_frame) {
+        return;
+    }
+    if (spectator_fps > 0) {
+        int64_t elapsed_ns = (now->tv_sec - last_render.tv_sec) * 1000000000LL
+                           + (now->tv_nsec - last_render.tv_nsec);
+        if (elapsed_ns < 1000000000LL / spectator_fps) {
+            return;
+        }
+    }
+
+    write_output(nethack_state);
+    last_render = *now;
+    last_frame = nethack_state->FrameCount;
 }
 
 // Extract color from TMT char
@@ -114,8 +429,9 @@ error:
 static void tmt_callback_handle_char(NetHackState *nethack_state,
                                      size_t r, size_t c, TMTCHAR *tmt_c)
 {
-    nethack_state->ScreenChar[r * VT_W + c] = tmt_c->c & 0xff;
-    nethack_state->ScreenColor[r * VT_W + c] = tmt_char_color(tmt_c);
+    int i = screen_index(nethack_state, r, c);
+    nethack_state->ScreenChar[i] = tmt_c->c & 0xff;
+    nethack_state->ScreenColor[i] = tmt_char_color(tmt_c);
 }
 
 // Called when we tmt_write()
@@ -135,15 +451,21 @@ static void nhbot_tmt_callback(tmt_msg_t m, TMT *vt, const void *a, void *p)
         break;
     case TMT_MSG_UPDATE:
         for (r = 0; r < s->nline; r++) {
-            if(s->lines[r]->dirty) {
+            if(tmt_line(s, r)->dirty) {
+                int i = screen_index(nethack_state, r, 0);
+                uint64_t h;
+                nethack_state->DirtyRows |= 1ULL << r;
                 for (c = 0; c < s->ncol; c++) {
-                    TMTCHAR *tmt_c = &(s->lines[r]->chars[c]);
+                    TMTCHAR *tmt_c = &tmt_line(s, r)->chars[c];
                     tmt_callback_handle_char(nethack_state, r, c, tmt_c);
                 }
+                h = frame_hash_row(&nethack_state->ScreenChar[i],
+                                   &nethack_state->ScreenColor[i], s->ncol, r);
+                nethack_state->FrameHash ^= nethack_state->RowHash[r] ^ h;
+                nethack_state->RowHash[r] = h;
             }
         }
-        nethack_state->ScreenChar[r * VT_W + c] = 0;
-        nethack_state->ScreenColor[r * VT_W + c] = 0;
+        nethack_state->FrameCount++;
         tmt_clean(vt);
         break;
     default:
@@ -215,192 +537,166 @@ static void screen_gather_blstats(NetHackState *nethack_state)
 
     // "St:"
     int guess = 1;
-    int offset = (VT_H-1) * VT_W + guess;
+    int offset = screen_index(nethack_state, VT_H - 2, guess);
     nethack_state->BlStat.St = screen_text_bl_int(
                                    offset, nethack_state->ScreenChar,
-                                   VT_H*VT_W, "St:", 3);
+                                   screen_cells(nethack_state), "St:", 3);
     // "Dx:"
     guess = 7;
-    offset = (VT_H-1) * VT_W + guess;
+    offset = screen_index(nethack_state, VT_H - 2, guess);
     nethack_state->BlStat.Dx = screen_text_bl_int(
                                    offset, nethack_state->ScreenChar,
-                                   VT_H*VT_W, "Dx:", 3);
+                                   screen_cells(nethack_state), "Dx:", 3);
     // "Co:"
     guess = 12;
-    offset = (VT_H-1) * VT_W + guess;
+    offset = screen_index(nethack_state, VT_H - 2, guess);
     nethack_state->BlStat.Co = screen_text_bl_int(
                                    offset, nethack_state->ScreenChar,
-                                   VT_H*VT_W, "Co:", 3);
+                                   screen_cells(nethack_state), "Co:", 3);
     // "In:"
     guess = 18;
-    offset = (VT_H-1) * VT_W + guess;
+    offset = screen_index(nethack_state, VT_H - 2, guess);
     nethack_state->BlStat.In = screen_text_bl_int(
                                    offset, nethack_state->ScreenChar,
-                                   VT_H*VT_W, "In:", 3);
+                                   screen_cells(nethack_state), "In:", 3);
     // "Wi:"
     guess = 23;
-    offset = (VT_H-1) * VT_W + guess;
+    offset = screen_index(nethack_state, VT_H - 2, guess);
     nethack_state->BlStat.Wi = screen_text_bl_int(
                                    offset, nethack_state->ScreenChar,
-                                   VT_H*VT_W, "Wi:", 3);
+                                   screen_cells(nethack_state), "Wi:", 3);
     // "Ch:"
     guess = 29;
-    offset = (VT_H-1) * VT_W + guess;
+    offset = screen_index(nethack_state, VT_H - 2, guess);
     nethack_state->BlStat.Ch = screen_text_bl_int(
                                    offset, nethack_state->ScreenChar,
-                                   VT_H*VT_W, "Ch:", 3);
+                                   screen_cells(nethack_state), "Ch:", 3);
     // "Dlvl:"
     guess = 0;
-    offset = (VT_H-0) * VT_W + guess;
+    offset = screen_index(nethack_state, VT_H - 1, guess);
     nethack_state->BlStat.Dlvl = screen_text_bl_int(
                                    offset, nethack_state->ScreenChar,
-                                   VT_H*VT_W, "Dlvl:", 5);
+                                   screen_cells(nethack_state), "Dlvl:", 5);
 
     // "$:"
     guess = 6;
-    offset = (VT_H-0) * VT_W + guess;
+    offset = screen_index(nethack_state, VT_H - 1, guess);
     nethack_state->BlStat.Money = screen_text_bl_int(
                                    offset, nethack_state->ScreenChar,
-                                   VT_H*VT_W, "$:", 2);
+                                   screen_cells(nethack_state), "$:", 2);
 
     // "HP"
     guess = 11;
-    offset = (VT_H-0) * VT_W + guess;
+    offset = screen_index(nethack_state, VT_H - 1, guess);
     nethack_state->BlStat.HP = screen_text_bl_int(
                                   offset, nethack_state->ScreenChar,
-                                  VT_H*VT_W, "HP:", 3);
+                                  screen_cells(nethack_state), "HP:", 3);
     // "Pw"
     guess = 18;
-    offset = (VT_H-0) * VT_W + guess;
+    offset = screen_index(nethack_state, VT_H - 1, guess);
     nethack_state->BlStat.Pw = screen_text_bl_int(
                                   offset, nethack_state->ScreenChar,
-                                  VT_H*VT_W, "Pw:", 3);
+                                  screen_cells(nethack_state), "Pw:", 3);
     // "Ac"
     guess = 27;
-    offset = (VT_H-0) * VT_W + guess;
+    offset = screen_index(nethack_state, VT_H - 1, guess);
     nethack_state->BlStat.Ac = screen_text_bl_int(
                                   offset, nethack_state->ScreenChar,
-                                  VT_H*VT_W, "Ac:", 3);
+                                  screen_cells(nethack_state), "Ac:", 3);
     // "Xp"
     guess = 32;
-    offset = (VT_H-0) * VT_W + guess;
+    offset = screen_index(nethack_state, VT_H - 1, guess);
     nethack_state->BlStat.Xp = screen_text_bl_int(
                                   offset, nethack_state->ScreenChar,
-                                  VT_H*VT_W, "Xp:", 3);
+                                  screen_cells(nethack_state), "Xp:", 3);
     // "T"
     guess = 38;
-    offset = (VT_H-0) * VT_W + guess;
+    offset = screen_index(nethack_state, VT_H - 1, guess);
     nethack_state->BlStat.T = screen_text_bl_int(
                                   offset, nethack_state->ScreenChar,
-                                  VT_H*VT_W, "T:", 2);
+                                  screen_cells(nethack_state), "T:", 2);
 }
 
+// Only the 80x24 the learners know is searched, a larger terminal has
+// nothing of the map outside it
 static void screen_locate_player(NetHackState *nethack_state)
 {
+    int rows = nethack_state->Rows < Y_MAX ? nethack_state->Rows : Y_MAX;
+    int cols = nethack_state->Cols < X_MAX ? nethack_state->Cols : X_MAX;
+
     nethack_state->PlayerRow = -1;
     nethack_state->PlayerCol = -1;
-    for (int i = 0; i < VT_W*VT_H; i++) {
-        if(nethack_state->ScreenChar[i] == '@'
-            && nethack_state->ScreenColor[i]&0x08) {
-            nethack_state->PlayerRow = i / VT_W;
-            nethack_state->PlayerCol= i % VT_W;
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            int i = screen_index(nethack_state, r, c);
+            if(nethack_state->ScreenChar[i] == '@'
+                && nethack_state->ScreenColor[i]&0x08) {
+                nethack_state->PlayerRow = r;
+                nethack_state->PlayerCol = c;
+            }
         }
     }
 }
 
-// Watch for text that requires user input,
-// send input, if necessary
-static void screen_respond_prompts(NetHackState *nethack_state, int fd)
+// NetHack asks this once the hero is dead
+static bool screen_game_over(NetHackState *nethack_state)
 {
-    char buf[64] = {0};
-
-    const char *more_text = "--More--";
-    const size_t more_text_len = strlen(more_text);
-
-    const char *yn_text = "[yn";
-    const size_t yn_text_len = strlen(yn_text);
-
-    const char *hungry_text = "Hungry";
-    const size_t hungry_text_len = strlen(hungry_text);
-
-    const char *burdened_text = "Burdened";
-    const size_t burdened_text_len = strlen(burdened_text);
-
-    const char *stressed_text= "Stressed";
-    const size_t stressed_text_len = strlen(stressed_text);
-
-    const char *call_a_text = "Call a";
-    const size_t call_a_text_len = strlen(call_a_text);
-
-    const char *hello_stranger_text = "Hello stranger";
-    const size_t hello_stranger_text_len = strlen(hello_stranger_text);
-
-    const char *what_do_you_want_text = "What do you want";
-    const size_t what_do_you_want_text_len = strlen(what_do_you_want_text);
-
-    const char *you_are_required_text = "You are required";
-    const size_t you_are_required_text_len = strlen(you_are_required_text);
-
-    // "--More--"
-    nethack_state->PromptMore = screen_text_exists(
-                                nethack_state->ScreenChar,
-                                VT_W*VT_H, more_text, more_text_len);
-
-    // "[yn"
-    nethack_state->PromptYn = screen_text_exists(
-                              nethack_state->ScreenChar,
-                              VT_W*VT_H, yn_text, yn_text_len);
-
-    // "Hungry"
-    nethack_state->StatusHungry = screen_text_exists(
-                                  nethack_state->ScreenChar,
-                                  VT_W*VT_H, hungry_text,
-                                  hungry_text_len);
-
-    // "Burdened"
-    nethack_state->StatusBurdened = screen_text_exists(
-                                    nethack_state->ScreenChar,
-                                    VT_W*VT_H, burdened_text,
-                                    burdened_text_len);
+    const char *dywypi_text = "possessions identified";
+    return screen_text_exists(nethack_state->ScreenChar, screen_cells(nethack_state),
+                              dywypi_text, strlen(dywypi_text));
+}
 
-    // "Stressed"
-    if (!nethack_state->StatusBurdened) {
-        nethack_state->StatusBurdened = screen_text_exists(
-                                        nethack_state->ScreenChar,
-                                        VT_W*VT_H, stressed_text,
-                                        stressed_text_len);
+// Fill QMap5x5 with the tile classes around the player
+static void screen_fill_qmap5x5(NetHackState *nethack_state)
+{
+    int i = 0;
+    int row = nethack_state->PlayerRow;
+    int col = nethack_state->PlayerCol;
+
+    for (int dy = -2; dy <= 2; dy++) {
+        for (int dx = -2; dx <= 2; dx++) {
+            int y = row + dy;
+            int x = col + dx;
+            int tile = TILE_WALL;
+            if (row == -1) {
+                tile = TILE_OTHER;
+            } else if (y >= 0 && y < Y_MAX && x >= 0 && x < X_MAX) {
+                tile = getTileClass(nethack_state, x, y);
+            }
+            nethack_state->QMap5x5[i++] = tile;
+        }
     }
+}
 
-    // "Call a"
-    if (screen_text_exists(nethack_state->ScreenChar,
-        VT_W*VT_H, call_a_text, call_a_text_len)) {
-        char string10[11];
-        random_string10(string10);
-        nhbot_write(fd, (uint8_t*)string10, 10);
-        nhbot_write(fd, (uint8_t*)"\n", 1);
-    }
-    // "Hello stranger"
-    if (screen_text_exists(nethack_state->ScreenChar,
-        VT_W*VT_H, hello_stranger_text, hello_stranger_text_len)) {
-        char string10[11];
-        random_string10(string10);
-        nhbot_write(fd, (uint8_t*)string10, 10);
-        nhbot_write(fd, (uint8_t*)"\n", 1);
-    }
-    // "You are required"
-    if (screen_text_exists(nethack_state->ScreenChar,
-        VT_W*VT_H, you_are_required_text, you_are_required_text_len)) {
-        char string10[11];
-        random_string10(string10);
-        nhbot_write(fd, (uint8_t*)string10, 10);
-        nhbot_write(fd, (uint8_t*)"\n", 1);
-    }
-    // "What do you want"
-    if (screen_text_exists(nethack_state->ScreenChar,
-        VT_W*VT_H, what_do_you_want_text, what_do_you_want_text_len)) {
-        nhbot_write(fd, (uint8_t*)"\n", 1);
-        nhbot_write(fd, (uint8_t*)"\n", 1);
+// Watch for text that requires user input, the game's protothread
+// answers it
+static void screen_scan_prompts(NetHackState *nethack_state)
+{
+    static const char *name_texts[] = {
+        "Call a",
+        "Hello stranger",
+        "You are required",
+    };
+    const char *more_text = "--More--";
+    const char *yn_text = "[yn";
+    const char *what_text = "What do you want";
+    uint8_t *screen = nethack_state->ScreenChar;
+    int cells = screen_cells(nethack_state);
+
+    nethack_state->PromptMore = screen_text_exists(screen, cells, more_text,
+                                                   strlen(more_text));
+    nethack_state->PromptYn = screen_text_exists(screen, cells, yn_text,
+                                                 strlen(yn_text));
+    nethack_state->PromptWhat = screen_text_exists(screen, cells, what_text,
+                                                   strlen(what_text));
+    nethack_state->PromptName = false;
+    for (size_t i = 0; i < sizeof(name_texts) / sizeof(*name_texts); i++) {
+        nethack_state->PromptName |= screen_text_exists(screen, cells,
+                                         name_texts[i], strlen(name_texts[i]));
     }
+    nethack_state->StatusHungry = screen_text_exists(screen, cells, "Hungry", 6);
+    nethack_state->StatusBurdened = screen_text_exists(screen, cells, "Burdened", 8)
+                                 || screen_text_exists(screen, cells, "Stressed", 8);
 }
 
 // Called before writing an action to NetHack
@@ -417,35 +713,7 @@ static int action_prologue(NetHackActionEnum action, int fd)
     return 0;
 }
 
-// Called after writing an action to NetHack
-static int action_epilogue(NetHackActionEnum action, int fd)
-{
-    switch(action) {
-    case Command_EAT:
-        switch(randrange(0, 2)) {
-        case 0:
-            nhbot_write(fd, (uint8_t*)"f", sizeof(uint8_t));
-            break;
-        case 1:
-            nhbot_write(fd, (uint8_t*)"g", sizeof(uint8_t));
-            break;
-        case 2:
-            nhbot_write(fd, (uint8_t*)"h", sizeof(uint8_t));
-            break;
-        }
-        break;
-    case Command_DROP:
-        nhbot_write(fd, (uint8_t*)"A", sizeof(uint8_t));
-        nhbot_write(fd, (uint8_t*)"\n", sizeof(uint8_t));
-        break;
-    default:
-        (void)fd;
-        break;
-    }
-    return 0;
-}
-
-// Call action prologue, write action char, call action epilogue
+// Call action prologue, write action char
 static int nhbot_perform_action(NetHackActionEnum action, int fd)
 {
     int result = -1;
@@ -460,121 +728,732 @@ static int nhbot_perform_action(NetHackActionEnum action, int fd)
     ssize_t len = sizeof(uint8_t);
     check(nhbot_write(fd, c, len) == len);
 
-    check(action_epilogue(action, fd) != -1);
-
 error:
     return result;
 }
 
 // Wrapper for nhbot_perform_action
-static int nhbot_action(NetHackActionEnum actionId)
+static int nhbot_action(struct io_params *params, NetHackActionEnum actionId)
 {
-    nethack_state.Action = NetHackActionLookup[actionId];
-    return nhbot_perform_action(actionId, master_write_fd);
+    params->nethack_state->Action = NetHackActionLookup[actionId];
+    return nhbot_perform_action(actionId, params->pty.master);
+}
+
+// Credit the previous move of the episode with the bottom line reward
+// that came in since, worker side
+static void nhbot_plan_credit(struct io_params *params, int state)
+{
+    NetHackState *nethack_state = &params->plan_state;
+
+    if (params->learn_action < 0
+     || params->learn_episode != params->plan_episode) {
+        return;
+    }
+    if (params->qmap) {
+        qmap_update(params->qmap, params->learn_state, params->learn_action,
+                    params->plan_reward, state);
+    } else {
+        pos_t from = { params->learn_row, params->learn_col };
+        pos_t to = { nethack_state->PlayerRow, nethack_state->PlayerCol };
+        CreditAgent(params->learner, &from, params->learn_action, &to,
+                    params->plan_reward);
+    }
+}
+
+// Moves the learner is sure of after plan_action, sent with it. The
+// path stops short of anything that looks like a monster, and of 'y'
+// (NW) and 'n' (SE), which would answer a [yn] prompt an earlier move
+// brought up.
+static void nhbot_plan_speculate(struct io_params *params)
+{
+    NetHackState *nethack_state = &params->plan_state;
+    pos_t start = { nethack_state->PlayerRow, nethack_state->PlayerCol };
+    pos_t cells[ NHBOT_SPEC_MAX + 1 ];
+    int n = SpeculateAgentPath(params->learner, start, params->plan_action,
+                               speculate, params->plan_move, cells);
+
+    for (int i = 0; i < n; i++) {
+        uint8_t ch = nethack_state->ScreenChar[
+                         screen_index(nethack_state, cells[ i ].y, cells[ i ].x)];
+        uint8_t key = NetHackActionLookup[ dirMove[ params->plan_move[ i ] ] ].ActionChar;
+        if (i > 0 && (isalpha(ch) || key == 'y' || key == 'n')) {
+            n = i;
+            break;
+        }
+        params->spec_row[ i ] = cells[ i ].y;
+        params->spec_col[ i ] = cells[ i ].x;
+    }
+    params->plan_moves = n;
+}
+
+// Finish a plan made on plan_state with value QMax where the player
+// stands. A fresh plan, not cached or random, heads for the frontier
+// when there is nothing learned to head for. Then the move to credit
+// next is noted and, when enabled, moves to send ahead are added.
+static void nhbot_plan_finish(struct io_params *params, int state, float QMax,
+                              bool fresh)
+{
+    NetHackState *nethack_state = &params->plan_state;
+
+    if (fresh && params->plan_frontier >= 0
+     && params->plan_frontier < qlearnConfig.actions && QMax <= 0) {
+        params->plan_action = params->plan_frontier;
+    }
+
+    params->learn_action = params->plan_action;
+    params->learn_state = state;
+    params->learn_row = nethack_state->PlayerRow;
+    params->learn_col = nethack_state->PlayerCol;
+    params->learn_episode = params->plan_episode;
+
+    // The next reward is credited to the last move sent ahead, if the
+    // player gets that far
+    params->plan_moves = 1;
+    if (speculate > 0 && !params->qmap) {
+        nhbot_plan_speculate(params);
+        if (params->plan_moves > 1) {
+            int last = params->plan_moves - 1;
+            params->learn_action = params->plan_move[ last ];
+            params->learn_row = params->spec_row[ last - 1 ];
+            params->learn_col = params->spec_col[ last - 1 ];
+        }
+    }
 }
 
-static void send_input(NetHackState *nethack_state, int fd)
+// Planning task, runs on a worker thread. A frame planned before picks
+// again from the values it was planned with, without learning, and a
+// stuck one gets a random move.
+static void nhbot_plan_step(void *arg)
 {
+    struct io_params *params = arg;
+    NetHackState *nethack_state = &params->plan_state;
+    uint64_t patterns[ Y_MAX ][ X_MAX ];
+    uint64_t key = nethack_state->FrameHash;
+    bool stuck = params->plan_stuck;
+    bool hit = false;
+    int state = 0;
+    double QVal[ MAX_ACTIONS ];
+    unsigned legal = 0;
     pos_t agent;
 
-    screen_respond_prompts(nethack_state, fd);
+    // The last decision's frame back again is a move that did nothing,
+    // it is planned again rather than looked up
+    if (stuck) {
+        framecache_drop(params->framecache, key);
+    } else if (!params->plan_repeat) {
+        hit = framecache_get(params->framecache, key, QVal, &legal);
+    }
 
-    if (nethack_state->PromptMore) {
-        nhbot_action(TextCharacters_SPACE);
-        nhbot_action(TextCharacters_SPACE);
-    } else if(nethack_state->PromptYn) {
-        nhbot_action(TextCharacters_n);
+    if (params->qmap) {
+        state = qmap_index(qmap_pattern(nethack_state->QMap5x5));
+        nhbot_plan_credit(params, state);
+        if (stuck) {
+            params->plan_action = getRand(&params->qmap->seed,
+                                          qlearnConfig.actions);
+        } else if (hit) {
+            params->plan_action = ChoosePolicyAction(QVal, legal,
+                                                     &params->qmap->epsilon,
+                                                     &params->qmap->seed);
+        } else {
+            int epochs;
+            params->plan_action = nhbot_qmap_plan_until(params->qmap, nethack_state,
+                                                        params->plan_deadline_ns,
+                                                        &epochs, &legal);
+            params->epochs += epochs;
+            for (int a = 0; a < MAX_ACTIONS; a++) {
+                QVal[ a ] = params->qmap->QVal[ state ][ a ];
+            }
+        }
+        goto done;
     }
 
-    if (nethack_state->StatusHungry) {
-        nhbot_action(Command_EAT);
+    agent.y = nethack_state->PlayerRow;
+    agent.x = nethack_state->PlayerCol;
+    nhbot_qlearn_set_env(params->learner, nethack_state);
+    if (hit) {
+        nhbot_plan_credit(params, state);
+        params->plan_action = ChoosePolicyAction(QVal, legal,
+                                                 &params->learner->epsilon,
+                                                 &params->learner->seed);
+        goto done;
+    }
+    if (qshare) {
+        qshare_seed(qshare, params->learner, patterns);
+    }
+    nhbot_plan_credit(params, state);
+    if (!stuck) {
+        // The epochs walk the agent away, the move is chosen where it is
+        pos_t walk = agent;
+        params->epochs += nhbot_qlearn_until(params->learner, &walk,
+                                             params->plan_deadline_ns);
     }
-    if (nethack_state->StatusBurdened) {
-        nhbot_action(Command_DROP);
+    if (qshare) {
+        qshare_merge(qshare, params->learner, patterns);
     }
+    params->plan_action = ChooseAgentAction(params->learner, &agent,
+                                            stuck ? EXPLORE : POLICY);
+    legal = LegalActions(params->learner, &agent);
+    memcpy(QVal, params->learner->stateSpace[ agent.y ][ agent.x ].QVal,
+           sizeof(QVal));
+
+done:
+    nhbot_plan_finish(params, state,
+                      params->qmap ? params->qmap->QMax[ state ]
+                                   : params->learner->stateSpace[ agent.y ][ agent.x ].QMax,
+                      !hit && !stuck);
+    if (!hit && !stuck) {
+        framecache_put(params->framecache, key, QVal, legal);
+    }
+    __atomic_store_n(&params->plan_done, true, __ATOMIC_RELEASE);
+    if (write(wake_pipe[1], "", 1) == -1) {
+        // Pipe is full, the io loop is awake anyway
+    }
+}
 
-    if (nethack_state->PlayerRow != -1
-     && nethack_state->PlayerCol != -1) {
-        agent.y = nethack_state->PlayerRow;
-        agent.x = nethack_state->PlayerCol;
-        nhbot_qlearn_set_env(nethack_state);
-        nhbot_qlearn(nethack_state, &agent);
-        switch(ChooseAgentAction(nethack_state, &agent, EXPLORE)) {
-        case 0:
-            nhbot_action(CompassDirection_N);
-            break;
-        case 1:
-            nhbot_action(CompassDirection_E);
-            break;
-        case 2:
-            nhbot_action(CompassDirection_S);
-            break;
-        case 3:
-            nhbot_action(CompassDirection_W);
-            break;
-        case 4:
-            nhbot_action(CompassDirection_NE);
-            break;
-        case 5:
-            nhbot_action(CompassDirection_NW);
-            break;
-        case 6:
-            nhbot_action(CompassDirection_SE);
-            break;
-        case 7:
-            nhbot_action(CompassDirection_SW);
-            break;
+// Log the frame a move was planned on, the move, and what the previous
+// move of the episode earned
+static void trajectory_record(struct io_params *params, NetHackActionEnum move)
+{
+    NetHackState *nethack_state = &params->plan_state;
+    const NetHackBlStat *bl = &nethack_state->BlStat;
+    const NetHackBlStat *last = params->last_blstat_valid
+                              ? &params->last_blstat : bl;
+    struct timespec now;
+    traj_record_t rec = {
+        .game = params->id,
+        .episode = params->episode,
+        .step = params->decisions,
+        .BlStat = *bl,
+        .PlayerRow = nethack_state->PlayerRow,
+        .PlayerCol = nethack_state->PlayerCol,
+        .action = move,
+        .dMoney = (int32_t)(bl->Money - last->Money),
+        .dXp = (int32_t)(bl->Xp - last->Xp),
+        .dDlvl = (int32_t)(bl->Dlvl - last->Dlvl),
+        .dHP = (int32_t)(bl->HP - last->HP),
+    };
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rec.time_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    for (int i = 0; i < 5*5; i++) {
+        rec.QMap5x5[i] = nethack_state->QMap5x5[i];
+    }
+    traj_push(&traj, &rec);
+
+    // Before the status line is drawn every stat reads 0
+    params->last_blstat = *bl;
+    params->last_blstat_valid = bl->Dlvl != 0;
+}
+
+// Send the move chosen by the planning worker
+static void send_planned_action(struct io_params *params)
+{
+    // Planned for a game that has since ended
+    if (params->plan_discard) {
+        params->plan_discard = false;
+        params->plan_action = -1;
+    }
+
+    if (params->plan_action >= 0 && params->plan_action < MAX_ACTIONS) {
+        NetHackActionEnum move = dirMove[params->plan_action];
+        // Never with moves sent ahead, -K and -T exclude each other
+        if (trajectories) {
+            trajectory_record(params, move);
+        }
+        nhbot_action(params, move);
+
+        // The rest go out now, the screen is checked as they land
+        if (params->plan_moves > 1) {
+            for (int i = 1; i < params->plan_moves; i++) {
+                nhbot_action(params, dirMove[params->plan_move[i]]);
+            }
+            params->spec_moves = params->plan_moves;
+            params->spec_at = -1;
+            params->spec_idle = 0;
+            params->spec_start_ns = nhbot_now_ns();
+            params->spec_sent += params->plan_moves - 1;
         }
     }
+    params->plan_done = false;
+    params->plan_busy = false;
+    params->decisions++;
+    budget_record(&budget, nhbot_now_ns() - params->plan_submit_ns);
+}
+
+// Decide for every game in the batch, io loop side.
+// There are no epochs to run, the tables learn from the real rewards.
+static void nhbot_plan_batch(void)
+{
+    qbatch_index(&batch);
+    for (int g = 0; g < batch.n; g++) {
+        nhbot_plan_credit(batch_games[ g ], batch.state[ g ]);
+    }
+    qbatch_choose(&batch);
+
+    for (int g = 0; g < batch.n; g++) {
+        struct io_params *params = batch_games[ g ];
+        int state = batch.state[ g ];
+
+        params->plan_action = params->plan_stuck
+                            ? getRand(&params->qmap->seed, qlearnConfig.actions)
+                            : batch.action[ g ];
+        nhbot_plan_finish(params, state, params->qmap->QMax[ state ],
+                          !params->plan_stuck);
+        params->plan_done = true;
+    }
+    batch.n = 0;
+}
+
+// Queue a game for the next batch, deciding for a full one first
+static void nhbot_batch_add(struct io_params *params)
+{
+    if (batch.n == QBATCH_MAX) {
+        nhbot_plan_batch();
+    }
+    batch_games[ batch.n ] = params;
+    qbatch_add(&batch, params->qmap, params->plan_state.QMap5x5);
+}
+
+// Remember the frame a decision is made on, true when it is one of
+// the last few already seen often enough to be going nowhere
+static bool nhbot_stuck(struct io_params *params, uint64_t key)
+{
+    int repeats = 0;
+
+    for (int i = 0; i < NHBOT_RECENT; i++) {
+        repeats += params->recent_hash[ i ] == key;
+    }
+    params->recent_hash[ params->recent_next ] = key;
+    params->recent_next = (params->recent_next + 1) % NHBOT_RECENT;
+    if (repeats + 1 >= NHBOT_STUCK_REPEATS) {
+        params->stuck++;
+        return true;
+    }
+    return false;
+}
+
+// Hand the frame to a worker, or the batch, false if there is no player
+// to plan for. The move is sent when plan_done is set.
+static bool nhbot_plan_submit(struct io_params *params)
+{
+    NetHackState *nethack_state = params->nethack_state;
+
+    if (nethack_state->PlayerRow == -1 || nethack_state->PlayerCol == -1) {
+        return false;
+    }
+    params->plan_state = *nethack_state;
+    params->plan_reward = reward_take(params->reward);
+    params->plan_episode = params->episode;
+    params->plan_repeat = params->recent_hash[
+                              (params->recent_next + NHBOT_RECENT - 1) % NHBOT_RECENT]
+                        == nethack_state->FrameHash;
+    params->plan_stuck = nhbot_stuck(params, nethack_state->FrameHash);
+    params->plan_frontier = levelmap_frontier_step(params->levelmap,
+                                                   nethack_state->PlayerRow,
+                                                   nethack_state->PlayerCol);
+    params->plan_submit_ns = nhbot_now_ns();
+    params->plan_deadline_ns = budget_deadline(&budget, params->plan_submit_ns);
+    if (nethack_state->BlStat.T > params->last_turn) {
+        budget_turns(&budget, params->last_turn
+                              ? nethack_state->BlStat.T - params->last_turn : 0);
+        params->last_turn = nethack_state->BlStat.T;
+    }
+    params->plan_busy = true;
+    if (batch_policy) {
+        nhbot_batch_add(params);
+    } else if (sched_submit(&sched, params->id, nhbot_plan_step, params) == -1) {
+        params->plan_busy = false;
+        return false;
+    }
+    return true;
+}
+
+// Write keys NetHack answers by redrawing the screen
+static void nhbot_keys(struct io_params *params, const char *keys)
+{
+    nhbot_write(params->pty.master, (uint8_t*)keys, strlen(keys));
+    params->key_frame = params->nethack_state->FrameCount;
+    params->key_deadline_ns = nhbot_now_ns() + NHBOT_KEY_TIMEOUT_NS;
+}
+
+// The keys were sent too long ago to still expect an answer
+static bool nhbot_key_timed_out(struct io_params *params)
+{
+    return nhbot_now_ns() > params->key_deadline_ns;
 }
 
-static void screen_wait_change(struct io_params *params)
+// The screen changed since the keys were sent, or never will
+static bool nhbot_key_answered(struct io_params *params)
+{
+    return params->nethack_state->FrameCount != params->key_frame
+        || nhbot_key_timed_out(params);
+}
+
+static bool nhbot_screen_shows(struct io_params *params, const char *text)
+{
+    NetHackState *nethack_state = params->nethack_state;
+    return screen_text_exists(nethack_state->ScreenChar,
+                              screen_cells(nethack_state), text, strlen(text));
+}
+
+// The control flow of a game, a protothread resumed by the io loop on
+// every pass. It answers one prompt at a time and waits for the screen
+// to move on before the next key, so no key lands on a screen it was
+// not meant for. Eating and dropping wait for their menus, and a move
+// waits for its worker and for the moves sent ahead of it.
+static int nhbot_game_resume(struct io_params *params)
+{
+    static const char *eat_letters[] = { "f", "g", "h" };
+    NetHackState *nethack_state = params->nethack_state;
+    pt_t *pt = &params->pt;
+    char name[12];
+
+    PT_BEGIN(pt);
+    for (;;) {
+        screen_scan_prompts(nethack_state);
+
+        if (nethack_state->PromptName) {
+            random_string10(name);
+            name[10] = '\n';
+            name[11] = '\0';
+            nhbot_keys(params, name);
+            PT_WAIT_UNTIL(pt, nhbot_key_answered(params));
+            continue;
+        }
+        if (nethack_state->PromptWhat) {
+            nhbot_keys(params, "\n");
+            PT_WAIT_UNTIL(pt, nhbot_key_answered(params));
+            continue;
+        }
+        if (nethack_state->PromptMore) {
+            nhbot_keys(params, " ");
+            PT_WAIT_UNTIL(pt, nhbot_key_answered(params));
+            continue;
+        }
+        if (nethack_state->PromptYn
+         && nethack_state->RowHash[0] != params->yn_answered) {
+            params->yn_answered = nethack_state->RowHash[0];
+            nhbot_keys(params, "n");
+            PT_WAIT_UNTIL(pt, nethack_state->RowHash[0] != params->yn_answered
+                           || nhbot_key_timed_out(params));
+            // Unchanged means the key was lost, ask again
+            params->yn_answered = nethack_state->RowHash[0] != params->yn_answered
+                                ? nethack_state->RowHash[0] : 0;
+            continue;
+        }
+
+        // Eat from the inventory, if there is anything to eat
+        if (nethack_state->StatusHungry && params->decisions >= params->eat_after) {
+            nhbot_keys(params, "me");
+            PT_WAIT_UNTIL(pt, nhbot_screen_shows(params, "What do you want to eat")
+                           || nhbot_key_timed_out(params));
+            if (nhbot_screen_shows(params, "What do you want to eat")) {
+                nhbot_keys(params, eat_letters[randrange(0, 2)]);
+                PT_WAIT_UNTIL(pt, nhbot_key_answered(params));
+            } else {
+                params->eat_after = params->decisions + NHBOT_RETRY_DECISIONS;
+            }
+            continue;
+        }
+
+        // Drop everything from the item class menu
+        if (nethack_state->StatusBurdened && params->decisions >= params->drop_after) {
+            nhbot_keys(params, "D");
+            PT_WAIT_UNTIL(pt, nhbot_screen_shows(params, "Drop what type")
+                           || nhbot_key_timed_out(params));
+            if (nhbot_screen_shows(params, "Drop what type")) {
+                nhbot_keys(params, "A");
+                PT_WAIT_UNTIL(pt, nhbot_key_answered(params));
+                nhbot_keys(params, "\n");
+                PT_WAIT_UNTIL(pt, nhbot_key_answered(params));
+            } else {
+                params->drop_after = params->decisions + NHBOT_RETRY_DECISIONS;
+            }
+            continue;
+        }
+
+        // Plan a move, send it and let the screen catch up
+        if (!nhbot_plan_submit(params)) {
+            PT_YIELD(pt);
+            continue;
+        }
+        PT_WAIT_UNTIL(pt, __atomic_load_n(&params->plan_done, __ATOMIC_ACQUIRE));
+        send_planned_action(params);
+        PT_WAIT_UNTIL(pt, params->spec_moves == 0);
+        PT_YIELD(pt);
+    }
+    PT_END(pt);
+}
+
+// Stop speculating short of the last move. The reward was to go to that
+// move from the cell before it, which the player never stood on, so
+// nothing is credited for this step.
+static void nhbot_spec_abort(struct io_params *params)
+{
+    params->spec_aborts++;
+    params->spec_moves = 0;
+    params->learn_action = -1;
+}
+
+// Follow the player along the moves sent ahead. Speculation ends when
+// the last one shows up, or at the first surprise: a prompt, a monster
+// next to the player, the player somewhere unexpected or not moving.
+// A prompt is escaped. Keys still queued are moves other than 'y' and
+// 'n', which a [yn] prompt does not take and --More-- ignores.
+static void nhbot_spec_follow(struct io_params *params)
+{
+    NetHackState *nethack_state = params->nethack_state;
+    const char *more_text = "--More--";
+    const char *yn_text = "[yn";
+    int row = nethack_state->PlayerRow;
+    int col = nethack_state->PlayerCol;
+    bool surprise = false;
+    int at;
+
+    if (params->spec_moves == 0) {
+        return;
+    }
+    if (nethack_state->DirtyRows == 0) {
+        if (nhbot_now_ns() - params->spec_start_ns > SPEC_TIMEOUT_NS) {
+            nhbot_spec_abort(params);
+        }
+        return;
+    }
+
+    if (screen_text_exists(nethack_state->ScreenChar,
+                           screen_cells(nethack_state),
+                           more_text, strlen(more_text))
+     || screen_text_exists(nethack_state->ScreenChar,
+                           screen_cells(nethack_state),
+                           yn_text, strlen(yn_text))) {
+        nhbot_write(params->pty.master, (uint8_t*)"\033", 1);
+        surprise = true;
+    } else if (row != -1) {
+        for (at = params->spec_at + 1; at < params->spec_moves; at++) {
+            if (params->spec_row[at] == row && params->spec_col[at] == col) {
+                break;
+            }
+        }
+        if (at < params->spec_moves) {
+            params->spec_at = at;
+            params->spec_idle = 0;
+        } else if (params->spec_at >= 0
+                 ? (params->spec_row[params->spec_at] == row
+                 && params->spec_col[params->spec_at] == col)
+                 : (params->plan_state.PlayerRow == row
+                 && params->plan_state.PlayerCol == col)) {
+            params->spec_idle++;
+        } else {
+            surprise = true;
+        }
+
+        for (int dy = -1; dy <= 1 && !surprise; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                int y = row + dy;
+                int x = col + dx;
+                if ((dy || dx) && y >= 0 && y < nethack_state->Rows
+                 && x >= 0 && x < nethack_state->Cols
+                 && isalpha(nethack_state->ScreenChar[
+                                screen_index(nethack_state, y, x)])) {
+                    surprise = true;
+                }
+            }
+        }
+    } else {
+        params->spec_idle++;
+    }
+
+    if (surprise || params->spec_idle > SPEC_IDLE_MAX) {
+        nhbot_spec_abort(params);
+    } else if (params->spec_at == params->spec_moves - 1) {
+        params->spec_moves = 0;
+    }
+}
+
+// Wait for output from any game, or for a finished plan, with select()
+static void screen_wait_select(void)
 {
     ssize_t nread;
     fd_set readable;
-    int maxfd = params->pty.master;
+    int maxfd = wake_pipe[0];
     struct timeval tv = {0, 1000 * 32};
     static char buf[BUFLEN];
-    
-    struct PTY pty = params->pty;
-    TMT *vt = params->vt;
 
     FD_ZERO(&readable);
-    FD_SET(pty.master, &readable);
+    FD_SET(wake_pipe[0], &readable);
+    if (streaming) {
+        stream_fdset(&stream, &readable, &maxfd);
+    }
+    for (int i = 0; i < ngames + nspares; i++) {
+        FD_SET(games[i].pty.master, &readable);
+        if (games[i].pty.master > maxfd) {
+            maxfd = games[i].pty.master;
+        }
+    }
+    io_syscalls++;
     if (select(maxfd + 1, &readable, NULL, NULL, &tv) == -1) {
-        fprintf(stderr, "select():%s:%d ", __FILE__, __LINE__);
+        if (errno != EINTR) {
+            fprintf(stderr, "select():%s:%d ", __FILE__, __LINE__);
+        }
         return;
     }
 
-    if (kill(params->pid, 0) == -1) {
-        return;
+    if (FD_ISSET(wake_pipe[0], &readable)) {
+        do {
+            io_syscalls++;
+        } while (read(wake_pipe[0], buf, BUFLEN) > 0);
+    }
+    if (streaming) {
+        stream_poll(&stream, &readable);
     }
 
-    if (FD_ISSET(pty.master, &readable)) {
-        if ((nread = read(pty.master, buf, BUFLEN)) <= 0) {
-            fprintf(stderr, "read():%s:%d ", __FILE__, __LINE__);
+    // Spares are read too, so their pty never fills up
+    for (int i = 0; i < ngames + nspares; i++) {
+        struct io_params *params = &games[i];
+
+        if (params->pid <= 0) {
+            continue;
+        }
+
+        if (FD_ISSET(params->pty.master, &readable)) {
+            io_syscalls++;
+            if ((nread = read(params->pty.master, buf, BUFLEN)) <= 0) {
+                fprintf(stderr, "read():%s:%d ", __FILE__, __LINE__);
+                continue;
+            }
+            tmt_write(params->vt, buf, nread);
+        }
+    }
+}
+
+// Output of a game, or the wake pipe, from io_uring
+static void screen_read_uring(void *arg, int fd, const uint8_t *data, size_t n)
+{
+    static char buf[BUFLEN];
+
+    (void)arg;
+    if (fd == wake_pipe[0]) {
+        do {
+            io_syscalls++;
+        } while (read(wake_pipe[0], buf, BUFLEN) > 0);
+        return;
+    }
+    for (int i = 0; i < ngames + nspares; i++) {
+        if (games[i].pty.master == fd) {
+            if (games[i].pid > 0) {
+                tmt_write(games[i].vt, (const char *)data, n);
+            }
             return;
         }
-        tmt_write(vt, buf, nread);
     }
 }
 
-// Main io loop
+// Wait for output from any game, or for a finished plan, with io_uring.
+// Keys queued since the last wait are submitted by the same call, and
+// their completions alone do not end the wait.
+static void screen_wait_uring(void)
+{
+    uint64_t deadline = nhbot_now_ns() + 32000000ULL;
+    uint64_t now;
+    int waited;
+
+    uring_poll(&uring, wake_pipe[0]);
+    for (int i = 0; i < ngames + nspares; i++) {
+        uring_read(&uring, games[i].pty.master);
+    }
+    // Past the deadline the wait only submits the writes and times out
+    do {
+        now = nhbot_now_ns();
+        if ((waited = uring_wait(&uring, now < deadline ? deadline - now : 0)) == -1) {
+            fprintf(stderr, "io_uring_enter():%s:%d ", __FILE__, __LINE__);
+        }
+    } while (uring_reap(&uring, screen_read_uring, NULL) == 0
+          && waited == 0 && nhbot_now_ns() < deadline);
+
+    // Viewers are few and slow, a select() that does not wait serves them
+    if (streaming) {
+        struct timeval tv = {0, 0};
+        fd_set readable;
+        int maxfd = -1;
+
+        FD_ZERO(&readable);
+        stream_fdset(&stream, &readable, &maxfd);
+        io_syscalls++;
+        if (select(maxfd + 1, &readable, NULL, NULL, &tv) > 0) {
+            stream_poll(&stream, &readable);
+        }
+    }
+}
+
+static void screen_wait_change(void)
+{
+    if (use_uring) {
+        screen_wait_uring();
+    } else {
+        screen_wait_select();
+    }
+}
+
+static void nhbot_reap_games(void);
+
+// Main io loop, single threaded, planning happens on the workers
+// * Send finished plans to NetHack
+// * Respond to prompts and queue a plan for every idle game
 // * Wait for screen change
 // * Process screen text
-// * Genreate qmap
-// * Process qmap
-// * Send resulting action to NetHack
-static void nhbot_loop(struct io_params *params)
+static void nhbot_loop(void)
 {
-    ssize_t nread;
-    NetHackState *nethack_state = params->nethack_state;
-    for(;;) {
-        send_input(nethack_state, params->pty.master);
-        screen_wait_change(params);
-        screen_gather_blstats(nethack_state);
-        screen_locate_player(nethack_state);
-        write_output(nethack_state);
+    struct timespec now;
+
+    while (!nhbot_stopping) {
+        if (nhbot_child_exited) {
+            nhbot_child_exited = 0;
+            nhbot_reap_games();
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (checkpoint_interval > 0
+         && now.tv_sec - checkpoint_time.tv_sec >= checkpoint_interval) {
+            nhbot_checkpoint();
+        }
+
+        for (int i = 0; i < ngames; i++) {
+            nhbot_game_resume(&games[i]);
+        }
+        if (batch.n) {
+            int n = batch.n;
+            nhbot_plan_batch();
+            for (int g = 0; g < n; g++) {
+                nhbot_game_resume(batch_games[ g ]);
+            }
+        }
+        screen_wait_change();
+        for (int i = 0; i < ngames; i++) {
+            // The bottom line is parsed only when it was redrawn
+            if (games[i].nethack_state->DirtyRows & REWARD_STATUS_ROWS) {
+                screen_gather_blstats(games[i].nethack_state);
+                reward_update(games[i].reward, &games[i].nethack_state->BlStat);
+            }
+            screen_locate_player(games[i].nethack_state);
+            nhbot_spec_follow(&games[i]);
+            screen_fill_qmap5x5(games[i].nethack_state);
+            levelmap_update(games[i].levelmap, games[i].nethack_state,
+                            games[i].nethack_state->DirtyRows);
+
+            // Skip the end of game screens, SIGCHLD restarts it
+            if (screen_game_over(games[i].nethack_state)
+             && games[i].pid > 0) {
+                kill(games[i].pid, SIGKILL);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        spectator_render(&now);
+        if (streaming) {
+            stream_publish(&stream, games);
+        }
+        for (int i = 0; i < ngames + nspares; i++) {
+            games[i].nethack_state->DirtyRows = 0;
+        }
     }
 
     return;
@@ -597,71 +1476,392 @@ error:
     return -1;
 }
 
-// Parent process, i.e., io loop
+// Parent process, get past the NetHack intro
 static int fork_handle_parent(struct io_params *params)
 {
-    int wait_status;
-    pthread_t io_thread_id;
+    check(write(params->pty.master, " ", sizeof(char)) != -1)
+    check(write(params->pty.master, " ", sizeof(char)) != -1)
 
-    dup2(params->pty.master, master_write_fd);
-    check(write(master_write_fd, " ", sizeof(char)) != -1)
-    check(write(master_write_fd, " ", sizeof(char)) != -1)
-    nhbot_loop(params);
-    waitpid(pid, &wait_status, WUNTRACED);
-    nhbot_shutdown();
-    puts("nhbot: exiting...");
+    return 0;
 
-    exit(0);
+error:
+    return -1;
+}
+
+// Create the pty and terminal for a game
+static int nhbot_open_game(struct io_params *params)
+{
+    struct winsize ws = { .ws_row = vt_rows, .ws_col = vt_cols };
+
+    // Create the pty descriptors, NetHack sizes its windows from ws
+    check(openpty(&params->pty.master, &params->pty.slave, NULL, NULL, &ws) != -1);
+    // select() takes descriptors below FD_SETSIZE only
+    if (!use_uring && params->pty.master >= FD_SETSIZE) {
+        fprintf(stderr, "nhbot: too many games for select(), use fewer or -i uring\n");
+        goto error;
+    }
+    check(fcntl(params->pty.master, F_SETFD, FD_CLOEXEC) != -1);
+    // io_uring issues I/O on a non-blocking file at once, in order,
+    // instead of handing it to a kernel thread
+    if (use_uring) {
+        check(fcntl(params->pty.master, F_SETFL, O_NONBLOCK) != -1);
+    }
+    check(fcntl(params->pty.slave, F_SETFD, FD_CLOEXEC) != -1);
+    check(ptsname_r(params->pty.master, params->pty.name,
+                    sizeof(params->pty.name)) == 0);
+
+    // Create the TMT virtual term
+    params->nethack_state->Rows = vt_rows;
+    params->nethack_state->Cols = vt_cols;
+#ifdef TMT_FIXED
+    check((params->vt = tmt_open_in(vt_arena + params->id * vt_size,
+                                    vt_rows, vt_cols, nhbot_tmt_callback,
+                                    params->nethack_state, NULL)));
+#else
+    check((params->vt = tmt_open(vt_rows, vt_cols, nhbot_tmt_callback,
+                                 params->nethack_state, NULL)));
+#endif
+
+    return 0;
 
 error:
     return -1;
 }
 
-// Start the NetHack bot with some options
-static int nhbot_run(const char *nethack_path, const char *env_term,
-              const char *env_nethackoptions)
+// Start NetHack with posix_spawn. glibc implements it with
+// clone(CLONE_VM|CLONE_VFORK), so unlike fork() the cost does not grow
+// with the learner tables and ptys the parent holds. The child gets a
+// new session, and opening the pty slave then makes it the controlling
+// terminal, which is what fork_handle_child() does by hand.
+static int spawn_game_process(struct io_params *params)
+{
+    static char *const argv[] = { "", NULL };
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    sigset_t defaults;
+    int err;
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID
+                                  | POSIX_SPAWN_SETSIGMASK
+                                  | POSIX_SPAWN_SETSIGDEF);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, params->pty.name, O_RDWR, 0);
+    posix_spawn_file_actions_adddup2(&actions, 0, 1);
+    posix_spawn_file_actions_adddup2(&actions, 0, 2);
+
+    err = posix_spawn(&params->pid, params->nethack_path, &actions, &attr,
+                      argv, (char *const *)params->env);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err != 0) {
+        params->pid = 0;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Launch NetHack on the game's pty
+static int nhbot_spawn_game(struct io_params *params)
+{
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (spawn_with_fork) {
+        // Fork! ==E
+        check((params->pid = fork()) != -1);
+        if (params->pid == 0) {
+            // Child process
+            fork_handle_child(&params->pty, params->nethack_path, params->env);
+            _exit(127);
+        }
+    } else {
+        check(spawn_game_process(params) != -1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (affinity_pin_game(&affinity, params->id, params->pid) == -1) {
+        fprintf(stderr, "nhbot: could not pin game %d\n", params->id);
+    }
+
+    uint64_t ns = (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000ULL
+                + (uint64_t)(t1.tv_nsec - t0.tv_nsec);
+    spawn_count++;
+    spawn_ns_total += ns;
+    if (ns > spawn_ns_max) {
+        spawn_ns_max = ns;
+    }
+
+    // Parent process
+    check(fork_handle_parent(params) != -1);
+
+    return 0;
+
+error:
+    return -1;
+}
+
+// Hand a running NetHack, with its pty, terminal and screen, to another slot
+static void nhbot_swap_process(struct io_params *a, struct io_params *b)
 {
-    // TMT virtual term
-    TMT *tmt_vt;
+    struct io_params tmp = *a;
+
+    a->pid = b->pid;
+    a->pty = b->pty;
+    a->vt = b->vt;
+    a->nethack_state = b->nethack_state;
+    a->nethack_username = b->nethack_username;
+    a->env_nethackoptions = b->env_nethackoptions;
+    a->env_hackdir = b->env_hackdir;
+    memcpy(a->env, b->env, sizeof(a->env));
+
+    b->pid = tmp.pid;
+    b->pty = tmp.pty;
+    b->vt = tmp.vt;
+    b->nethack_state = tmp.nethack_state;
+    b->nethack_username = tmp.nethack_username;
+    b->env_nethackoptions = tmp.env_nethackoptions;
+    b->env_hackdir = tmp.env_hackdir;
+    memcpy(b->env, tmp.env, sizeof(b->env));
+}
 
-    // The pty for nethack
-    struct PTY pty;
+// A game ended, promote a spare in its place and restart NetHack on
+// the freed pty and terminal
+static void nhbot_end_episode(struct io_params *params)
+{
+    struct io_params *freed = params;
+
+    if (params - games < ngames) {
+        episodes++;
+        params->episode++;
+        params->last_blstat_valid = false;
+        reward_reset(params->reward);
+        levelmap_reset(params->levelmap);
+        params->plan_discard = params->plan_busy;
+        params->spec_moves = 0;
+        memset(params->recent_hash, 0, sizeof(params->recent_hash));
+        params->last_turn = 0;
+        params->yn_answered = 0;
+        // A plan still out is discarded where the protothread waits for it
+        if (!params->plan_busy) {
+            PT_INIT(&params->pt);
+        }
+        for (int i = ngames; i < ngames + nspares; i++) {
+            if (games[i].pid > 0) {
+                nhbot_swap_process(params, &games[i]);
+                affinity_pin_game(&affinity, params->id, params->pid);
+                // Its screen was drawn while nobody parsed it
+                params->nethack_state->DirtyRows = ~0ULL;
+                freed = &games[i];
+                break;
+            }
+        }
+    }
 
-    // Our env consists of term and nethack options
-    const char *env[] = {
-        env_term,
-        env_nethackoptions,
-        NULL
-    };
+    memset(freed->nethack_state, 0, sizeof(NetHackState));
+    freed->nethack_state->Rows = vt_rows;
+    freed->nethack_state->Cols = vt_cols;
+    tmt_reset(freed->vt);
+    if (nhbot_spawn_game(freed) == -1) {
+        fprintf(stderr, "nhbot: could not restart game %d\n", freed->id);
+    }
+}
+
+// Reap exited NetHack processes and restart them
+static void nhbot_reap_games(void)
+{
+    pid_t child;
+    int status;
+
+    while ((child = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < ngames + nspares; i++) {
+            struct io_params *params = &games[i];
+            if (params->pid != child) {
+                continue;
+            }
+            params->pid = 0;
+            // exec failed, restarting would only spin
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+                fprintf(stderr, "nhbot: %s could not be started\n",
+                        params->nethack_path);
+                nhbot_stopping = 1;
+                break;
+            }
+            nhbot_end_episode(params);
+            break;
+        }
+    }
+}
+
+// Build the environment of a slot: term, nethack options naming the
+// game after the slot, and HACKDIR when games get private playgrounds
+static int nhbot_game_env(struct io_params *params,
+                          const struct nhbot_options *opts,
+                          const char *env_term,
+                          const char *env_nethackoptions)
+{
+    char *username;
+    char *options;
+    char *dir = NULL;
+    char *hackdir;
+    int n = 0;
+
+    check(asprintf(&username, "%s%d", opts->username, params->id) != -1);
+    check(asprintf(&options, "%s,name:%s", env_nethackoptions, username) != -1);
+    params->nethack_username = username;
+    params->env_term = env_term;
+    params->env_nethackoptions = options;
+    params->env[ n++ ] = env_term;
+    params->env[ n++ ] = options;
+
+    if (opts->hackdir) {
+        check(asprintf(&dir, "%s/%s", opts->playground, username) != -1);
+        if (playground_create(opts->hackdir, dir) == -1) {
+            fprintf(stderr, "nhbot: could not create playground %s\n", dir);
+            goto error;
+        }
+        check(asprintf(&hackdir, "HACKDIR=%s", dir) != -1);
+        params->env_hackdir = hackdir;
+        params->env[ n++ ] = hackdir;
+        free(dir);
+    }
+    params->env[ n ] = NULL;
+
+    return 0;
+
+error:
+    free(dir);
+    return -1;
+}
+
+// Start the NetHack bot with some options
+static int nhbot_run(const struct nhbot_options *opts, const char *env_term,
+              const char *env_nethackoptions)
+{
+    NetHackState *states;
+    int nslots = opts->games + opts->spares;
+
+    spawn_with_fork = opts->spawn_fork;
+    speculate = opts->speculate;
+    batch_policy = opts->batch;
+    budget_init(&budget, (uint64_t)opts->latency_ms * 1000000ULL);
+    check(affinity_init(&affinity, opts->affinity, opts->workers) != -1);
+    if (opts->uring) {
+        use_uring = uring_init(&uring) == 0;
+        if (!use_uring) {
+            fprintf(stderr, "nhbot: io_uring is not available, using select()\n");
+        }
+    }
+    vt_cols = opts->cols;
+    vt_rows = opts->rows;
+    spectator_fps = opts->headless ? -1 : opts->spectator_fps;
+
+    // Start from the last checkpoint, if there is one
+    checkpoint_path = opts->checkpoint_path;
+    checkpoint_interval = opts->checkpoint_interval;
+    if (checkpoint_path && ckpt_map(&checkpoint, checkpoint_path) == 0) {
+        fprintf(stderr, "nhbot: loaded checkpoint %s\n", checkpoint_path);
+    }
 
     // Handle sigint to kill nethack
     check(signal(SIGINT, handle_signal) != SIG_ERR);
+    check(signal(SIGTERM, handle_signal) != SIG_ERR);
+    check(signal(SIGCHLD, handle_signal) != SIG_ERR);
 
-    // Create the pty descriptors
-    check(openpty(&pty.master, &pty.slave, NULL, NULL, NULL) != -1);
+    // Workers wake the io loop through a non-blocking pipe
+    check(pipe2(wake_pipe, O_NONBLOCK | O_CLOEXEC) != -1);
 
-    // Create the TMT virtual term
-    check((tmt_vt = tmt_open(VT_H, VT_W, nhbot_tmt_callback, &nethack_state, NULL)));
-
-    // Initialize thread params
-    struct io_params io_params = {
-        .nethack_path = nethack_path,
-        .env_term = env_term,
-        .env_nethackoptions = env_nethackoptions,
-        .pty = pty,
-        .vt = tmt_vt,
-        .nethack_state = &nethack_state,
-    };
+    if (opts->hackdir) {
+        check(mkdir(opts->playground, 0755) != -1 || errno == EEXIST);
+        errno = 0;
+    }
+
+    // Before the ptys, so select() can always take the listening socket
+    if (opts->stream_path) {
+        check(stream_open(&stream, opts->stream_path, opts->games) != -1);
+        streaming = true;
+    }
+
+    check((games = calloc(nslots, sizeof(struct io_params))));
+    check((states = calloc(nslots, sizeof(NetHackState))));
+#ifdef TMT_FIXED
+    vt_size = tmt_size(vt_rows, vt_cols);
+    check((vt_arena = aligned_alloc(TMT_ALIGN, vt_size * nslots)));
+#endif
+
+    for (int i = 0; i < nslots; i++) {
+        struct io_params *params = &games[i];
+
+        // Initialize game params
+        params->id = i;
+        params->nethack_path = opts->nethack_path;
+        check(nhbot_game_env(params, opts, env_term, env_nethackoptions) != -1);
+        params->nethack_state = &states[i];
+        if (i >= opts->games) {
+            // Spare, only the process part is used
+            nspares++;
+            check(nhbot_open_game(params) != -1);
+            check(nhbot_spawn_game(params) != -1);
+            continue;
+        }
+        if (opts->learner == LEARNER_QMAP) {
+            void *table;
+            check((params->qmap = calloc(1, sizeof(qmap_t))));
+            check((table = nhbot_table(CKPT_QMAP, i, QMAP_TABLE_SIZE)));
+            qmap_attach(params->qmap, table);
+            params->qmap->seed = i + 1;
+            params->qmap->epsilon = qlearnConfig.epsilon;
+        } else {
+            check((params->learner = calloc(1, sizeof(qlearn_t))));
+            check((params->learner->stateSpace =
+                       nhbot_table(CKPT_GRID, i, QLEARN_TABLE_SIZE)));
+            params->learner->seed = i + 1;
+            params->learner->epsilon = qlearnConfig.epsilon;
+        }
 
-    // Fork! ==E
-    check((pid = fork()) != -1);
-    if (pid == 0) {
-        // Child process
-        check(fork_handle_child(&pty, nethack_path, env) != -1);
-    } else if (pid > 0) {
-        // Parent process
-        check(fork_handle_parent(&io_params) != -1);
+        check((params->reward = calloc(1, sizeof(reward_t))));
+        check((params->levelmap = calloc(1, sizeof(levelmap_t))));
+        check((params->framecache = calloc(1, sizeof(framecache_t))));
+        params->learn_action = -1;
+
+        ngames++;
+        check(nhbot_open_game(params) != -1);
+        check(nhbot_spawn_game(params) != -1);
+    }
+
+    if (opts->traj_prefix) {
+        check(traj_open(&traj, opts->traj_prefix) != -1);
+        trajectories = true;
+    }
+
+    if (opts->shared) {
+        void *table;
+        check((table = nhbot_table(CKPT_QSHARE, 0, QSHARE_TABLE_SIZE)));
+        check((qshare = qshare_new(table)));
+    }
+
+    check(sched_init(&sched, opts->workers, opts->games) != -1);
+    for (int w = 0; w < sched.nworkers; w++) {
+        if (affinity_pin_worker(&affinity, w, sched.threads[w]) == -1) {
+            fprintf(stderr, "nhbot: could not pin worker %d\n", w);
+        }
     }
+    affinity_report(&affinity);
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    checkpoint_time = start_time;
+    nhbot_loop();
+    nhbot_shutdown();
 
     return 0;
 
@@ -672,17 +1872,213 @@ error:
 
 
 // Start the NetHack bot with some options
-static void run(void)
+static void run(const struct nhbot_options *opts)
 {
-    nhbot_run("/usr/bin/nethack",
+    nhbot_run(opts,
             "TERM=ansi",
             "NETHACKOPTIONS=time:true,splash_screen:no,"
             "role:Knight,race:human,gender:male,align:lawful");
 }
 
-int main(void)
+static void usage(const char *prog)
 {
-    run();
-    return 0;
+    fprintf(stderr,
+            "usage: %s [-n games] [-j workers] [-p nethack_path] [-s]"
+            " [-L learner]\n"
+            "       [-C checkpoint] [-I seconds] [-P spares] [-F] [-H] [-f fps]\n"
+            "       [-S socket] [-T prefix] [-c config] [-o key=value]\n"
+            "       [-u name] [-D hackdir] [-G dir] [-V colsxrows] [-K moves]\n"
+            "       [-B] [-l ms] [-A where] [-i backend]\n"
+            "  -n games    number of concurrent NetHack games (default 1)\n"
+            "  -j workers  planning threads (default: online cpus, at most games)\n"
+            "  -p path     NetHack binary (default /usr/bin/nethack)\n"
+            "  -s          share Q-values between games by local view\n"
+            "  -L learner  grid (per screen cell) or qmap (5x5 local view)\n"
+            "  -C path     load learner tables from and save them to path\n"
+            "  -I seconds  checkpoint interval (default 300, 0 only on exit)\n"
+            "  -P spares   pre-started games kept ready for restarts (default 1)\n"
+            "  -F          launch NetHack with fork() instead of posix_spawn()\n"
+            "  -H          headless, do not render to stdout\n"
+            "  -f fps      render game 0 at most fps times a second (default 10,\n"
+            "              0 on every change)\n"
+            "  -S path     stream frame deltas to viewers on a Unix socket\n"
+            "  -T prefix   log every decision to prefix.<time>.<pid>.<n>.traj\n"
+            "  -c path     read learner settings (key=value lines) from path\n"
+            "  -o key=val  set a learner setting: learning_rate, discount,\n"
+            "              epochs, qmap_epochs, actions, policy (greedy,\n"
+            "              egreedy, softmax), epsilon, epsilon_decay,\n"
+            "              epsilon_min, temperature\n"
+            "  -u name     games play as name0, name1, ... (default nhbot)\n"
+            "  -D path     give every game a private copy of the playground\n"
+            "              at path, e.g. /usr/lib/games/nethack. path must be\n"
+            "              honoured as HACKDIR: a NetHack that is not setgid,\n"
+            "              started directly rather than by a wrapper script\n"
+            "  -G dir      where the private playgrounds go (default\n"
+            "              nhbot-games)\n"
+            "  -V size     terminal of every game, e.g. 132x50 (default 80x24,\n"
+            "              at most 132x64)\n"
+            "  -K moves    send up to moves confident grid learner moves ahead\n"
+            "              of the screen, checked as they land (default 0,\n"
+            "              and not with -T, which logs each move's screen)\n"
+            "  -B          with -L qmap, decide for all ready games at once on\n"
+            "              the io thread, learning only from real rewards\n"
+            "              (the decisions of -o qmap_epochs=0, whatever it is)\n"
+            "  -l ms       cut planning short to keep the p99 latency of a\n"
+            "              decision under ms (default 0, always plan fully)\n"
+            "  -A where    pin workers and NetHack: none (default), core (a\n"
+            "              worker and its games on one cpu) or l2 (a worker on\n"
+            "              one cpu, its games on the others sharing its L2)\n"
+            "  -i backend  pty I/O with select (default) or uring (io_uring,\n"
+            "              select if the kernel cannot)\n",
+            prog);
 }
 
+int main(int argc, char **argv)
+{
+    int opt;
+    struct nhbot_options opts = {
+        .nethack_path = "/usr/bin/nethack",
+        .games = 1,
+        .workers = 0,
+        .checkpoint_interval = 300,
+        .spares = 1,
+        .spectator_fps = 10,
+        .username = "nhbot",
+        .playground = "nhbot-games",
+        .cols = VT_W,
+        .rows = VT_H,
+    };
+
+    while ((opt = getopt(argc, argv, "n:j:p:sL:C:I:P:FHf:S:T:c:o:u:D:G:V:K:Bl:A:i:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            opts.games = atoi(optarg);
+            break;
+        case 'j':
+            opts.workers = atoi(optarg);
+            break;
+        case 'p':
+            opts.nethack_path = optarg;
+            break;
+        case 's':
+            opts.shared = true;
+            break;
+        case 'C':
+            opts.checkpoint_path = optarg;
+            break;
+        case 'I':
+            opts.checkpoint_interval = atoi(optarg);
+            break;
+        case 'P':
+            opts.spares = atoi(optarg);
+            break;
+        case 'F':
+            opts.spawn_fork = true;
+            break;
+        case 'H':
+            opts.headless = true;
+            break;
+        case 'f':
+            opts.spectator_fps = atoi(optarg);
+            break;
+        case 'S':
+            opts.stream_path = optarg;
+            break;
+        case 'T':
+            opts.traj_prefix = optarg;
+            break;
+        case 'u':
+            opts.username = optarg;
+            break;
+        case 'D':
+            opts.hackdir = optarg;
+            break;
+        case 'G':
+            opts.playground = optarg;
+            break;
+        case 'B':
+            opts.batch = true;
+            break;
+        case 'l':
+            opts.latency_ms = atoi(optarg);
+            break;
+        case 'K':
+            opts.speculate = atoi(optarg);
+            break;
+        case 'V':
+            if (sscanf(optarg, "%dx%d", &opts.cols, &opts.rows) != 2) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            if (config_load(optarg) == -1) {
+                return 1;
+            }
+            break;
+        case 'o':
+            if (config_arg(optarg) == -1) {
+                return 1;
+            }
+            break;
+        case 'i':
+            if (strcmp(optarg, "select") == 0) {
+                opts.uring = false;
+            } else if (strcmp(optarg, "uring") == 0) {
+                opts.uring = true;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'A':
+            if (strcmp(optarg, "none") == 0) {
+                opts.affinity = AFFINITY_NONE;
+            } else if (strcmp(optarg, "core") == 0) {
+                opts.affinity = AFFINITY_CORE;
+            } else if (strcmp(optarg, "l2") == 0) {
+                opts.affinity = AFFINITY_L2;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'L':
+            if (strcmp(optarg, "grid") == 0) {
+                opts.learner = LEARNER_GRID;
+            } else if (strcmp(optarg, "qmap") == 0) {
+                opts.learner = LEARNER_QMAP;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (opts.games < 1 || opts.spares < 0 || opts.spectator_fps < 0
+     || opts.cols < VT_W || opts.cols > VT_W_MAX
+     || opts.rows < VT_H || opts.rows > VT_H_MAX
+     || opts.speculate < 0 || opts.speculate > NHBOT_SPEC_MAX
+     || (opts.speculate && opts.traj_prefix)
+     || (opts.batch && opts.learner != LEARNER_QMAP)
+     || opts.latency_ms < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opts.workers < 1) {
+        opts.workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (opts.workers > opts.games) {
+        opts.workers = opts.games;
+    }
+    if (opts.workers < 1) {
+        opts.workers = 1;
+    }
+
+    run(&opts);
+    return 0;
+}
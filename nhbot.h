@@ -5,14 +5,27 @@
 #include <stdint.h>
 #include <errno.h>
 #include <stdbool.h>
+#include "pt.h"
 #include "tmt.h"
 
 
 #define iswall(c) ((c) == '-' || (c) == '|')
+// Default terminal. NetHack draws its map and status lines in this
+// corner of any larger one, so the learners only ever look at it.
 #define VT_W 80
 #define VT_H 24
 
-#define BUFLEN ((VT_W * VT_H) * 2)
+// Frame hashes of the last decisions kept to spot a game going nowhere
+#define NHBOT_RECENT 8
+
+// Most moves sent ahead of the screen
+#define NHBOT_SPEC_MAX 16
+
+// Largest terminal, DirtyRows has a bit per row
+#define VT_W_MAX 132
+#define VT_H_MAX 64
+
+#define BUFLEN ((VT_W_MAX * VT_H_MAX) * 2)
 
 #define check(x)\
 if (!(x)) {\
@@ -63,6 +76,7 @@ typedef enum {
 struct PTY {
     int master;
     int slave;
+    char name[64];
 };
 
 typedef struct {
@@ -88,30 +102,187 @@ typedef struct {
 } NetHackAction;
 
 typedef struct {
-    uint8_t ScreenChar[VT_W*VT_H];
-    uint8_t ScreenColor[VT_W*VT_H];
+    // Rows lines of Cols cells, Cols is also the row stride
+    uint8_t ScreenChar[VT_W_MAX*VT_H_MAX];
+    uint8_t ScreenColor[VT_W_MAX*VT_H_MAX];
+    int Rows;
+    int Cols;
     int CursorRow;
     int CursorCol;
     int PlayerRow;
     int PlayerCol;
     bool PromptMore;
     bool PromptYn;
+    bool PromptWhat;
+    bool PromptName;
     bool StatusHungry;
     bool StatusBurdened;
     NetHackAction Action;
     NetHackBlStat BlStat;
     int QMap5x5[5*5];
+    uint32_t FrameCount;
+    uint64_t DirtyRows;
+    // Hash of every row, and their xor, updated as rows are redrawn
+    uint64_t RowHash[VT_H_MAX];
+    uint64_t FrameHash;
 } NetHackState;
 
+// Index of a screen cell
+static inline int screen_index(const NetHackState *nethack_state, int r, int c)
+{
+    return r * nethack_state->Cols + c;
+}
+
+// Number of screen cells
+static inline int screen_cells(const NetHackState *nethack_state)
+{
+    return nethack_state->Rows * nethack_state->Cols;
+}
+
+struct qlearn;
+struct qmap;
+struct reward;
+struct levelmap;
+struct framecache;
+
+typedef enum {
+    LEARNER_GRID = 0,
+    LEARNER_QMAP,
+} NhbotLearner;
+
+// Where workers and NetHack processes run, see affinity.h
+typedef enum {
+    AFFINITY_NONE = 0,
+    AFFINITY_CORE,
+    AFFINITY_L2,
+} NhbotAffinity;
+
 struct io_params {
+    int id;
     pid_t pid;
     struct PTY pty;
     TMT *vt;
     NetHackState *nethack_state;
     const char *nethack_path;
+
+    // Every NetHack runs under its own name, and in its own playground
+    // when there is one. These belong to the process and move with it
+    // when a spare is promoted.
     const char *nethack_username;
     const char *env_term;
     const char *env_nethackoptions;
+    const char *env_hackdir;
+    const char *env[4];
+
+    // Planning, the worker only touches plan_state and plan_action
+    struct qlearn *learner;
+    struct qmap *qmap;
+    NetHackState plan_state;
+    int plan_action;
+    bool plan_busy;
+    bool plan_done;
+    bool plan_discard;
+    uint64_t decisions;
+
+    // Bottom line reward, kept by the io loop. plan_reward and
+    // plan_episode go to the worker with plan_state.
+    struct reward *reward;
+    float plan_reward;
+    uint32_t plan_episode;
+
+    // The move the worker planned last, credited with the next
+    // plan_reward if it belongs to the same episode
+    int learn_action;
+    int learn_state;
+    int learn_row;
+    int learn_col;
+    uint32_t learn_episode;
+
+    // Map memory of the levels seen this episode, and the first move
+    // towards the nearest frontier when the plan was queued
+    struct levelmap *levelmap;
+    int plan_frontier;
+
+    // Speculation. The worker plans plan_moves moves, the first one is
+    // plan_action and the rest are sent with it without waiting for the
+    // screen. spec_row/col[ i ] is where the player stands after move i.
+    // The io loop follows the player along them, spec_at is the last
+    // one seen, and stops at the first surprise.
+    int plan_moves;
+    int plan_move[ NHBOT_SPEC_MAX + 1 ];
+    int spec_row[ NHBOT_SPEC_MAX + 1 ];
+    int spec_col[ NHBOT_SPEC_MAX + 1 ];
+    int spec_moves;
+    int spec_at;
+    int spec_idle;
+    uint64_t spec_start_ns;
+    uint64_t spec_sent;
+    uint64_t spec_aborts;
+
+    // Moves planned on earlier frames, worker side. The io loop keeps
+    // the frame hashes of the last decisions, and a frame that keeps
+    // coming back sets plan_stuck: the worker then explores instead.
+    // plan_repeat is set when the frame is the last decision's, the
+    // move did nothing and is not looked up again.
+    struct framecache *framecache;
+    uint64_t recent_hash[ NHBOT_RECENT ];
+    int recent_next;
+    bool plan_stuck;
+    bool plan_repeat;
+    uint64_t stuck;
+
+    // Planning budget: when the plan was queued and when the worker must
+    // stop learning (0 never), the epochs it ran, and the turn counter
+    // at the last decision
+    uint64_t plan_submit_ns;
+    uint64_t plan_deadline_ns;
+    uint64_t epochs;
+    uint32_t last_turn;
+
+    // The game's protothread, the frame its last keys were sent on and
+    // when to stop waiting for an answer, and the decision count before
+    // which eating or dropping is not tried again after it had no menu
+    pt_t pt;
+    uint32_t key_frame;
+    uint64_t key_deadline_ns;
+    uint64_t eat_after;
+    uint64_t drop_after;
+
+    // Message row a [yn] prompt was left with once answered, the echo of
+    // the answer, while it shows the prompt is not asked again
+    uint64_t yn_answered;
+
+    // Trajectory log, episode counts finished games of this slot and
+    // last_blstat is the status at the previous logged decision
+    uint32_t episode;
+    NetHackBlStat last_blstat;
+    bool last_blstat_valid;
+};
+
+struct nhbot_options {
+    const char *nethack_path;
+    int games;
+    int workers;
+    bool shared;
+    NhbotLearner learner;
+    const char *checkpoint_path;
+    int checkpoint_interval;
+    int spares;
+    bool spawn_fork;
+    bool headless;
+    int spectator_fps;
+    const char *stream_path;
+    const char *traj_prefix;
+    const char *username;
+    const char *hackdir;
+    const char *playground;
+    int cols;
+    int rows;
+    int speculate;
+    bool batch;
+    int latency_ms;
+    NhbotAffinity affinity;
+    bool uring;
 };
 
 static NetHackAction NetHackActionLookup[] = {
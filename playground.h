@@ -0,0 +1,138 @@
+#ifndef _PLAYGROUND_H_
+#define _PLAYGROUND_H_
+
+// Private NetHack playgrounds.
+//
+// NetHack keeps its lock, score and save files in one playground
+// directory (HACKDIR). Games started side by side there fight over the
+// same files, so every game can get its own playground instead. It is
+// built from the system one: data files are hardlinked, which costs no
+// space, the score and log files start out empty, and save/ is a fresh
+// directory. Where hardlinks are not possible (another filesystem, or
+// protected_hardlinks and files we do not own) the file is copied.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "nhbot.h"
+
+// Files NetHack writes to, every playground gets its own
+static const char *playground_private[] = {
+    "record",
+    "logfile",
+    "xlogfile",
+    "livelog",
+    "perm",
+};
+
+static bool playground_is_private(const char *name)
+{
+    for (size_t i = 0; i < sizeof(playground_private) / sizeof(*playground_private); i++) {
+        if (strcmp(name, playground_private[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int playground_copy(const char *from, const char *to, mode_t mode)
+{
+    char buf[65536];
+    ssize_t n;
+    int in = -1;
+    int out = -1;
+
+    check((in = open(from, O_RDONLY | O_CLOEXEC)) != -1);
+    check((out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode)) != -1);
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        check(write(out, buf, n) == n);
+    }
+    check(n == 0);
+    close(in);
+    check(close(out) != -1);
+    return 0;
+
+error:
+    if (in != -1) {
+        close(in);
+    }
+    if (out != -1) {
+        close(out);
+    }
+    return -1;
+}
+
+// Lock files are named after the uid, "1000nhbot3.0", or end in _lock
+static bool playground_is_lock(const char *name)
+{
+    size_t len = strlen(name);
+    return (name[0] >= '0' && name[0] <= '9')
+        || (len > 5 && strcmp(name + len - 5, "_lock") == 0);
+}
+
+// Make dst a private playground built from src. An existing dst keeps
+// its scores and saves but loses stale locks of a previous run.
+int playground_create(const char *src, const char *dst)
+{
+    char from[4096];
+    char to[4096];
+    struct dirent *de;
+    struct stat st;
+    DIR *dir = NULL;
+    int fd;
+
+    check(mkdir(dst, 0755) != -1 || errno == EEXIST);
+    errno = 0;
+    check(snprintf(to, sizeof(to), "%s/save", dst) < (int)sizeof(to));
+    check(mkdir(to, 0755) != -1 || errno == EEXIST);
+    errno = 0;
+
+    // Stale locks would make NetHack ask about a game in progress
+    check((dir = opendir(dst)));
+    while ((de = readdir(dir))) {
+        if (playground_is_lock(de->d_name)) {
+            snprintf(to, sizeof(to), "%s/%s", dst, de->d_name);
+            unlink(to);
+        }
+    }
+    closedir(dir);
+
+    check((dir = opendir(src)));
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] == '.' || playground_is_lock(de->d_name)) {
+            continue;
+        }
+        check(snprintf(from, sizeof(from), "%s/%s", src, de->d_name) < (int)sizeof(from));
+        check(snprintf(to, sizeof(to), "%s/%s", dst, de->d_name) < (int)sizeof(to));
+        if (stat(from, &st) == -1 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        if (playground_is_private(de->d_name)) {
+            check((fd = open(to, O_WRONLY | O_CREAT | O_CLOEXEC, 0664)) != -1);
+            close(fd);
+            continue;
+        }
+        if (lstat(to, &st) == 0) {
+            continue;
+        }
+        if (link(from, to) == -1) {
+            check(playground_copy(from, to, 0644) != -1);
+        }
+    }
+    closedir(dir);
+    errno = 0;
+
+    return 0;
+
+error:
+    if (dir) {
+        closedir(dir);
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _PT_H_
+#define _PT_H_
+
+// Protothreads, stackless coroutines in the style of Adam Dunkels'.
+//
+// A protothread is a function that is called again and again, and a
+// switch on the line it last waited at takes it back to where it was.
+// It costs one int and no stack, so every game can have one and the io
+// loop can resume thousands of them without blocking. Locals do not
+// survive a wait, keep state where the function can find it again, and
+// do not wait inside a switch of your own.
+
+typedef struct {
+    int lc;
+    int yielded;
+} pt_t;
+
+#define PT_WAITING 0
+#define PT_ENDED   1
+
+#define PT_INIT(pt) (*(pt) = (pt_t){0})
+
+#define PT_BEGIN(pt) switch ((pt)->lc) { case 0:
+
+// Return until cond holds, checking it again on every resume
+#define PT_WAIT_UNTIL(pt, cond)                     \
+    do {                                            \
+        (pt)->lc = __LINE__;                        \
+        __attribute__((fallthrough));               \
+    case __LINE__:                                  \
+        if (!(cond)) {                              \
+            return PT_WAITING;                      \
+        }                                           \
+    } while (0)
+
+// Return once, carry on at the next resume
+#define PT_YIELD(pt)                                \
+    do {                                            \
+        (pt)->yielded = 0;                          \
+        (pt)->lc = __LINE__;                        \
+        __attribute__((fallthrough));               \
+    case __LINE__:                                  \
+        if (!(pt)->yielded++) {                     \
+            return PT_WAITING;                      \
+        }                                           \
+    } while (0)
+
+#define PT_END(pt) } PT_INIT(pt); return PT_ENDED;
+
+#endif
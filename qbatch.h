@@ -0,0 +1,169 @@
+#ifndef _QBATCH_H_
+#define _QBATCH_H_
+
+// Batched qmap policy.
+//
+// Without simulated epochs a qmap decision is a lookup: pack the 5x5
+// local view, hash it to a table row, read the Q-values and take the
+// best legal move. qbatch makes that decision for up to QBATCH_MAX games
+// at once. Every array is indexed [ field ][ game ], so each step is the
+// same operation over consecutive lanes and the compiler can keep it in
+// vector registers. Only the policy's random draws are per game.
+//
+// That is all that is batched. The decisions are those of the qmap
+// learner with qmap_epochs=0, the simulated epochs are not run at all,
+// and the grid learner, whose epochs walk a whole map, always plans
+// per game on the workers.
+
+#include <math.h>
+#include <stdint.h>
+#include "qlearn.h"
+#include "qmap.h"
+
+#define QBATCH_MAX 256
+
+typedef struct {
+    int n;
+    qmap_t *qmap[ QBATCH_MAX ];
+    uint8_t view[ 5*5 ][ QBATCH_MAX ];
+    uint64_t pattern[ QBATCH_MAX ];
+    int32_t state[ QBATCH_MAX ];
+    uint32_t legal[ QBATCH_MAX ];
+    float QVal[ MAX_ACTIONS ][ QBATCH_MAX ];
+    float best[ QBATCH_MAX ];
+    int32_t ties[ QBATCH_MAX ];
+    int32_t action[ QBATCH_MAX ];
+} qbatch_t;
+
+// Add a game's local view to the batch, its lane or -1 if it is full
+int qbatch_add(qbatch_t *b, qmap_t *qm, const int QMap5x5[ 5*5 ])
+{
+    int g = b->n;
+
+    if (g == QBATCH_MAX) {
+        return -1;
+    }
+    for (int k = 0; k < 5*5; k++) {
+        b->view[ k ][ g ] = (uint8_t)QMap5x5[ k ];
+    }
+    b->qmap[ g ] = qm;
+    b->n++;
+    return g;
+}
+
+// A random legal move of lane g
+static int qbatch_random(qbatch_t *b, int g, uint32_t among)
+{
+    int pick = getRand(&b->qmap[ g ]->seed, __builtin_popcount(among));
+
+    for (int a = 0; a < qlearnConfig.actions; a++) {
+        if ((among & (1u << a)) && pick-- == 0) {
+            return a;
+        }
+    }
+    return 0;
+}
+
+// Table row of every game in the batch, state[ g ]
+void qbatch_index(qbatch_t *b)
+{
+    const int n = b->n;
+
+    // Pack the views the way qmap_pattern() does and hash them
+    for (int g = 0; g < n; g++) {
+        b->pattern[ g ] = 0;
+    }
+    for (int k = 0; k < 5*5; k++) {
+        for (int g = 0; g < n; g++) {
+            b->pattern[ g ] = (b->pattern[ g ] << 2) | b->view[ k ][ g ];
+        }
+    }
+    for (int g = 0; g < n; g++) {
+        b->state[ g ] = qmap_index(b->pattern[ g ]);
+    }
+}
+
+// Move of every game in the batch by the configured policy, action[ g ].
+// Runs after qbatch_index(), the rows may be updated in between.
+void qbatch_choose(qbatch_t *b)
+{
+    const int n = b->n;
+
+    // A move is legal unless it runs into a wall next to the centre
+    for (int g = 0; g < n; g++) {
+        b->legal[ g ] = 0;
+    }
+    for (int a = 0; a < qlearnConfig.actions; a++) {
+        int k = (2 + dir[ a ].y) * 5 + 2 + dir[ a ].x;
+        for (int g = 0; g < n; g++) {
+            b->legal[ g ] |= (uint32_t)(b->view[ k ][ g ] != TILE_WALL) << a;
+        }
+    }
+
+    // Gather the Q-values of every game's row
+    for (int a = 0; a < qlearnConfig.actions; a++) {
+        for (int g = 0; g < n; g++) {
+            b->QVal[ a ][ g ] = b->qmap[ g ]->QVal[ b->state[ g ] ][ a ];
+        }
+    }
+
+    // Best legal move, and how many share its value
+    for (int g = 0; g < n; g++) {
+        b->best[ g ] = -INFINITY;
+        b->ties[ g ] = 0;
+        b->action[ g ] = -1;
+    }
+    for (int a = 0; a < qlearnConfig.actions; a++) {
+        for (int g = 0; g < n; g++) {
+            bool better = ((b->legal[ g ] >> a) & 1) && b->QVal[ a ][ g ] > b->best[ g ];
+            b->best[ g ] = better ? b->QVal[ a ][ g ] : b->best[ g ];
+            b->action[ g ] = better ? a : b->action[ g ];
+        }
+    }
+    for (int a = 0; a < qlearnConfig.actions; a++) {
+        for (int g = 0; g < n; g++) {
+            b->ties[ g ] += ((b->legal[ g ] >> a) & 1) && b->QVal[ a ][ g ] == b->best[ g ];
+        }
+    }
+
+    // The policy, per game: ties and exploration draw from its seed
+    for (int g = 0; g < n; g++) {
+        qmap_t *qm = b->qmap[ g ];
+        uint32_t tied = 0;
+
+        if (b->legal[ g ] == 0) {
+            b->action[ g ] = getRand(&qm->seed, qlearnConfig.actions);
+            continue;
+        }
+        if (qlearnConfig.policy == POLICY_SOFTMAX) {
+            double QVal[ MAX_ACTIONS ] = {0};
+            for (int a = 0; a < qlearnConfig.actions; a++) {
+                QVal[ a ] = b->QVal[ a ][ g ];
+            }
+            b->action[ g ] = ChoosePolicyAction(QVal, b->legal[ g ],
+                                                &qm->epsilon, &qm->seed);
+            continue;
+        }
+        if (qlearnConfig.policy == POLICY_EGREEDY) {
+            double explore = qm->epsilon;
+            qm->epsilon *= qlearnConfig.epsilonDecay;
+            if (qm->epsilon < qlearnConfig.epsilonMin) {
+                qm->epsilon = qlearnConfig.epsilonMin;
+            }
+            if (getSRand(&qm->seed) < explore) {
+                b->action[ g ] = qbatch_random(b, g, b->legal[ g ]);
+                continue;
+            }
+        }
+        if (b->ties[ g ] > 1) {
+            for (int a = 0; a < qlearnConfig.actions; a++) {
+                if (((b->legal[ g ] >> a) & 1) && b->QVal[ a ][ g ] == b->best[ g ]) {
+                    tied |= 1u << a;
+                }
+            }
+            b->action[ g ] = qbatch_random(b, g, tied);
+        }
+    }
+}
+
+#endif
@@ -9,12 +9,14 @@
 #include <math.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include "nhbot.h"
 
 #define X_MAX VT_W
 #define Y_MAX VT_H
 
 #define MAX_EPOCHS 100000
+#define QMAP_EPOCHS 10000
 
 #define MAX_ACTIONS 8
 
@@ -28,14 +30,68 @@ typedef struct {
    double QMax;
 } stateAction_t;
 
+// Width of the wall border around the environment, enough for a 5x5
+// window centred on any screen cell
+#define QLEARN_BORDER 2
+
+// Per-game learner, one per game so games can be planned in parallel.
+// environment holds the tile class of every screen cell inside a wall
+// border, so a neighbour or local window of an on-screen cell is always
+// in bounds. stateSpace points at QLEARN_TABLE_SIZE bytes, either heap
+// or a mapped checkpoint.
+typedef struct qlearn {
+   uint8_t environment[ Y_MAX + 2 * QLEARN_BORDER ][ X_MAX + 2 * QLEARN_BORDER ];
+   stateAction_t ( *stateSpace )[ X_MAX ];
+   unsigned int seed;
+   double epsilon;
+} qlearn_t;
+
+#define QLEARN_TABLE_SIZE ( sizeof( stateAction_t ) * Y_MAX * X_MAX )
+
 #define LEARNING_RATE	0.8	// alpha
 #define DISCOUNT_RATE   0.9	// gamma
 
 #define EXPLOIT         0   // Choose best Q
 #define EXPLORE         1   // Probabilistically choose best Q
+#define POLICY          2   // Choose by qlearnConfig.policy
+
+typedef enum {
+   POLICY_GREEDY = 0,   // Best legal Q, random on a tie
+   POLICY_EGREEDY,      // Random legal move with probability epsilon
+   POLICY_SOFTMAX,      // Legal moves weighted by exp(Q / temperature)
+} qlearnPolicy_t;
+
+// Runtime settings, the #defines above are the defaults. Set before the
+// workers start and only read after that.
+typedef struct {
+   double learningRate;
+   double discountRate;
+   int epochs;
+   int qmapEpochs;
+   int actions;            // Use the first actions entries of dir
+   qlearnPolicy_t policy;
+   double epsilon;         // Starting epsilon of every game
+   double epsilonDecay;    // Epsilon is multiplied by this every move
+   double epsilonMin;
+   double temperature;
+} qlearnConfig_t;
+
+qlearnConfig_t qlearnConfig =
+{
+   .learningRate = LEARNING_RATE,
+   .discountRate = DISCOUNT_RATE,
+   .epochs       = MAX_EPOCHS,
+   .qmapEpochs   = QMAP_EPOCHS,
+   .actions      = MAX_ACTIONS,
+   .policy       = POLICY_EGREEDY,
+   .epsilon      = 0.1,
+   .epsilonDecay = 0.999,
+   .epsilonMin   = 0.01,
+   .temperature  = 0.1,
+};
 
-#define getSRand()      ( ( double ) rand( ) / ( double ) RAND_MAX )
-#define getRand(x)      ( int )( ( double )( x ) * rand( ) / ( RAND_MAX+1.0 ) )
+#define getSRand(s)     ( ( double ) rand_r( s ) / ( double ) RAND_MAX )
+#define getRand(s, x)   ( int )( ( double )( x ) * rand_r( s ) / ( RAND_MAX+1.0 ) )
 
 const pos_t dir[ MAX_ACTIONS ] =
 {
@@ -50,52 +106,116 @@ const pos_t dir[ MAX_ACTIONS ] =
   {  1, -1 }   /* SW */
 };
 
-
-uint8_t environment[ Y_MAX * X_MAX ] = {0};
-
-static stateAction_t stateSpace[ Y_MAX ][ X_MAX ];
-
-void nhbot_qlearn_set_env(NetHackState *nethack_state)
+// NetHack move of each action above
+const NetHackActionEnum dirMove[ MAX_ACTIONS ] =
 {
-    memcpy(environment, nethack_state->ScreenChar, X_MAX*Y_MAX*sizeof(uint8_t));
-}
+  CompassDirection_N,
+  CompassDirection_E,
+  CompassDirection_S,
+  CompassDirection_W,
+
+  CompassDirection_NE,
+  CompassDirection_NW,
+  CompassDirection_SE,
+  CompassDirection_SW
+};
 
 
 //
-// Return the reward value for the state
+// Tile classes, shared by the reward and the local view features
 //
-int getReward(NetHackState *nethack_state, int x, int y)
+typedef enum {
+   TILE_OTHER = 0,
+   TILE_FLOOR,
+   TILE_WALL,
+   TILE_GOAL,
+} tileClass_t;
+
+// Tile class of a cell, anything up to QLEARN_BORDER off screen is a wall
+#define getEnv(q, y, x) \
+   ( ( q )->environment[ ( y ) + QLEARN_BORDER ][ ( x ) + QLEARN_BORDER ] )
+
+int getTileClass(NetHackState *nethack_state, int x, int y)
 {
-    uint8_t ch = nethack_state->ScreenChar[y * VT_W + x];
-    uint8_t c = nethack_state->ScreenColor[y * VT_W + x];
-    if (ch == '-' && c == (Brown|0x08)) { return 0; }
-    if (ch == '|' && c == (Brown|0x08)) { return 0; }
+    uint8_t ch = nethack_state->ScreenChar[screen_index(nethack_state, y, x)];
+    uint8_t c = nethack_state->ScreenColor[screen_index(nethack_state, y, x)];
+    if (ch == '-' && c == (Brown|0x08)) { return TILE_FLOOR; }
+    if (ch == '|' && c == (Brown|0x08)) { return TILE_FLOOR; }
     switch(ch) {
     case '-':
     case '|':
-        return -1;
+        return TILE_WALL;
     case '.':
-        return  0;
+        return TILE_FLOOR;
     case '$':
     case '/':
     case '>':
-        return  1;
+        return TILE_GOAL;
+   }
+   return TILE_OTHER;
+}
+
+//
+// Classify the screen into the bordered environment.
+//
+void nhbot_qlearn_set_env(qlearn_t *q, NetHackState *nethack_state)
+{
+   memset( q->environment, TILE_WALL, sizeof( q->environment ) );
+
+   for ( int y = 0 ; y < Y_MAX ; y++ )
+   {
+      for ( int x = 0 ; x < X_MAX ; x++ )
+      {
+         getEnv( q, y, x ) = getTileClass( nethack_state, x, y );
+      }
+   }
+}
+
+//
+// Return the reward value for the state
+//
+int getReward(qlearn_t *q, int x, int y)
+{
+   static const int tileReward[] = {
+      [TILE_OTHER] =  0,
+      [TILE_FLOOR] =  0,
+      [TILE_WALL]  = -1,
+      [TILE_GOAL]  =  1,
+   };
+   return tileReward[ getEnv( q, y, x ) ];
+}
+
+//
+// Pack the tile classes of the 5x5 window around a cell, 2 bits per
+// tile, row major. Off-screen tiles count as walls.
+//
+uint64_t getLocalPattern(qlearn_t *q, int y, int x)
+{
+   uint64_t pattern = 0;
+
+   for ( int dy = -2 ; dy <= 2 ; dy++ )
+   {
+      for ( int dx = -2 ; dx <= 2 ; dx++ )
+      {
+         pattern = ( pattern << 2 ) | ( uint64_t )getEnv( q, y + dy, x + dx );
+      }
    }
-   return 0;
+
+   return pattern;
 }
 
 //
 // Find and cache the largest Q-value for the state.
 //
-void CalculateMaxQ( int y, int x )
+void CalculateMaxQ( qlearn_t *q, int y, int x )
 {
-   stateSpace[ y ][ x ].QMax = 0.0;
+   q->stateSpace[ y ][ x ].QMax = 0.0;
 
    for ( int i = 0 ; i < MAX_ACTIONS ; i++ )
    {
-      if ( stateSpace[ y ][ x ].QVal[ i ] > stateSpace[ y ][ x ].QMax )
+      if ( q->stateSpace[ y ][ x ].QVal[ i ] > q->stateSpace[ y ][ x ].QMax )
       {
-         stateSpace[ y ][ x ].QMax = stateSpace[ y ][ x ].QVal[ i ];
+         q->stateSpace[ y ][ x ].QMax = q->stateSpace[ y ][ x ].QVal[ i ];
       }
    }
    
@@ -105,19 +225,102 @@ void CalculateMaxQ( int y, int x )
 //
 // Identify whether the desired move is legal.
 //
-int legalMove(NetHackState *nethack_state, int y_state, int x_state, int action )
+int legalMove(qlearn_t *q, int y_state, int x_state, int action )
 {
   int y = y_state + dir[ action ].y;
   int x = x_state + dir[ action ].x;
 
-  if (getReward(nethack_state, x, y) < 0 ) return 0;
-  else return 1;
+  return getEnv( q, y, x ) != TILE_WALL;
+}
+
+//
+// The legal actions from the agent's cell, bit a for action a.
+//
+unsigned LegalActions( qlearn_t *q, pos_t *agent )
+{
+   unsigned legal = 0;
+
+   for ( int a = 0 ; a < qlearnConfig.actions ; a++ )
+   {
+      if ( legalMove( q, agent->y, agent->x, a ) ) legal |= 1u << a;
+   }
+   return legal;
+}
+
+//
+// Pick one of the legal actions (bit a of legal) from their Q-values
+// with the configured policy. epsilon decays on every call.
+//
+int ChoosePolicyAction( const double QVal[ MAX_ACTIONS ], unsigned legal,
+                        double *epsilon, unsigned int *seed )
+{
+   int best = -1;
+   int ties = 0;
+   int nlegal = 0;
+
+   if ( legal == 0 )
+   {
+      return getRand( seed, qlearnConfig.actions );
+   }
+
+   for ( int a = 0 ; a < qlearnConfig.actions ; a++ )
+   {
+      if ( !( legal & ( 1u << a ) ) ) continue;
+      nlegal++;
+      if ( best == -1 || QVal[ a ] > QVal[ best ] )
+      {
+         best = a;
+         ties = 1;
+      }
+      else if ( QVal[ a ] == QVal[ best ] && getRand( seed, ++ties ) == 0 )
+      {
+         best = a;
+      }
+   }
+
+   if ( qlearnConfig.policy == POLICY_EGREEDY )
+   {
+      double explore = *epsilon;
+      *epsilon *= qlearnConfig.epsilonDecay;
+      if ( *epsilon < qlearnConfig.epsilonMin ) *epsilon = qlearnConfig.epsilonMin;
+
+      if ( getSRand( seed ) < explore )
+      {
+         int pick = getRand( seed, nlegal );
+         for ( int a = 0 ; a < qlearnConfig.actions ; a++ )
+         {
+            if ( ( legal & ( 1u << a ) ) && pick-- == 0 ) return a;
+         }
+      }
+   }
+   else if ( qlearnConfig.policy == POLICY_SOFTMAX && qlearnConfig.temperature > 0.0 )
+   {
+      double weight[ MAX_ACTIONS ];
+      double total = 0.0;
+
+      for ( int a = 0 ; a < qlearnConfig.actions ; a++ )
+      {
+         weight[ a ] = ( legal & ( 1u << a ) )
+                     ? exp( ( QVal[ a ] - QVal[ best ] ) / qlearnConfig.temperature )
+                     : 0.0;
+         total += weight[ a ];
+      }
+
+      double pick = getSRand( seed ) * total;
+      for ( int a = 0 ; a < qlearnConfig.actions ; a++ )
+      {
+         pick -= weight[ a ];
+         if ( weight[ a ] > 0.0 && pick <= 0.0 ) return a;
+      }
+   }
+
+   return best;
 }
 
 //
 // Choose an action based upon the selection policy.
 //
-int ChooseAgentAction(NetHackState *nethack_state, pos_t *agent, int actionSelection )
+int ChooseAgentAction(qlearn_t *q, pos_t *agent, int actionSelection )
 {
    int action;
 
@@ -126,8 +329,8 @@ int ChooseAgentAction(NetHackState *nethack_state, pos_t *agent, int actionSelec
    {
       for ( action = 0 ; action < MAX_ACTIONS ; action++ )
       {
-         if ( stateSpace[ agent->y ][ agent->x ].QVal[ action ] ==
-              stateSpace[ agent->y ][ agent->x ].QMax )
+         if ( q->stateSpace[ agent->y ][ agent->x ].QVal[ action ] ==
+              q->stateSpace[ agent->y ][ agent->x ].QMax )
          {
             break;
          }
@@ -137,54 +340,154 @@ int ChooseAgentAction(NetHackState *nethack_state, pos_t *agent, int actionSelec
    else if ( actionSelection == EXPLORE )
    {
       for (int tries = 0; tries< 100; tries++) {
-        action = getRand( MAX_ACTIONS );
-        if (legalMove(nethack_state, agent->y, agent->x, action )) {
+        action = getRand( &q->seed, qlearnConfig.actions );
+        if (legalMove(q, agent->y, agent->x, action )) {
             break;
         }
       }
    }
+   // Choose by the configured policy among the legal actions.
+   else
+   {
+      action = ChoosePolicyAction( q->stateSpace[ agent->y ][ agent->x ].QVal,
+                                   LegalActions( q, agent ), &q->epsilon, &q->seed );
+   }
 
    return action;
 }
 
 //
-// Update the agent using the Q-value function.
+// Update the agent using the Q-value function. A move into a wall,
+// which is every cell off screen, leaves the agent where it is, so the
+// agent never leaves the screen and no bounds checks are needed.
 //
-void UpdateAgent(NetHackState *nethack_state, pos_t *agent, int action )
+void UpdateAgent(qlearn_t *q, pos_t *agent, int action )
 {
    int newy = agent->y + dir[ action ].y;
    int newx = agent->x + dir[ action ].x;
+   int blocked = getEnv( q, newy, newx ) == TILE_WALL;
 
-   // Update the agent's position
-   if (newx < 0 || newx >= X_MAX ||
-       newy < 0 || newy >= Y_MAX) {
-       return;
-   }
+   double reward = (double)getReward(q, newx, newy);
 
-   double reward = (double)getReward(nethack_state, newx, newy);
+   newy = blocked ? agent->y : newy;
+   newx = blocked ? agent->x : newx;
 
    // Evaluate Q value 
-   stateSpace[ agent->y ][ agent->x ].QVal[ action ] += 
-     LEARNING_RATE * ( reward + ( DISCOUNT_RATE * stateSpace[ newy ][ newx ].QMax) -
-                        stateSpace[ agent->y ][ agent->x ].QVal[ action ] );
+   q->stateSpace[ agent->y ][ agent->x ].QVal[ action ] += 
+     qlearnConfig.learningRate * ( reward + ( qlearnConfig.discountRate * q->stateSpace[ newy ][ newx ].QMax) -
+                        q->stateSpace[ agent->y ][ agent->x ].QVal[ action ] );
 
-   CalculateMaxQ( agent->y, agent->x );
+   CalculateMaxQ( q, agent->y, agent->x );
 
    // Update the agent's position
-   if (newx >= 0 && newx < X_MAX &&
-       newy >= 0 && newy < Y_MAX) {
-       agent->x = newx;
-       agent->y = newy;
-   }
+   agent->x = newx;
+   agent->y = newy;
 
    return;
 }
 
-void nhbot_qlearn(NetHackState *nethack_state, pos_t *agent)
+//
+// Credit a move actually played in the game with the reward it earned.
+//
+void CreditAgent(qlearn_t *q, pos_t *from, int action, pos_t *to, double reward )
 {
-   for (int epochs = 0; epochs < MAX_EPOCHS; epochs++) {
-      int action = ChooseAgentAction(nethack_state, agent, EXPLORE );
-      UpdateAgent(nethack_state, agent, action);
+   q->stateSpace[ from->y ][ from->x ].QVal[ action ] +=
+     qlearnConfig.learningRate * ( reward + ( qlearnConfig.discountRate * q->stateSpace[ to->y ][ to->x ].QMax) -
+                        q->stateSpace[ from->y ][ from->x ].QVal[ action ] );
+
+   CalculateMaxQ( q, from->y, from->x );
+}
+
+//
+// Extend action with the moves the learner is sure of, to be sent ahead
+// of the screen. From where action lands, follow the best legal action
+// while its Q-value is positive, beats every other legal one by
+// SPEC_MARGIN of itself, and lands on a cell that is not a wall or a
+// goal and was not visited on the way. moves[ 0 ] is action and
+// cells[ i ] is where move i lands. Returns the number of moves, at
+// most 1 + ahead.
+//
+#define SPEC_MARGIN 0.1
+
+int SpeculateAgentPath( qlearn_t *q, pos_t agent, int action, int ahead,
+                        int moves[], pos_t cells[] )
+{
+   int n = 1;
+
+   moves[ 0 ] = action;
+   cells[ 0 ] = agent;
+   if ( !legalMove( q, agent.y, agent.x, action ) ) return 1;
+   cells[ 0 ].y += dir[ action ].y;
+   cells[ 0 ].x += dir[ action ].x;
+
+   while ( n <= ahead )
+   {
+      pos_t at = cells[ n - 1 ];
+      const double *QVal = q->stateSpace[ at.y ][ at.x ].QVal;
+      double second = -INFINITY;
+      int best = -1;
+      bool visited = false;
+
+      for ( int a = 0 ; a < qlearnConfig.actions ; a++ )
+      {
+         if ( !legalMove( q, at.y, at.x, a ) ) continue;
+         if ( best == -1 || QVal[ a ] > QVal[ best ] )
+         {
+            if ( best != -1 ) second = QVal[ best ];
+            best = a;
+         }
+         else if ( QVal[ a ] > second )
+         {
+            second = QVal[ a ];
+         }
+      }
+      if ( best == -1 || QVal[ best ] <= 0.0
+        || QVal[ best ] - second < SPEC_MARGIN * QVal[ best ] ) break;
+
+      pos_t next = { at.y + dir[ best ].y, at.x + dir[ best ].x };
+      if ( getEnv( q, next.y, next.x ) == TILE_GOAL ) break;
+      visited = next.y == agent.y && next.x == agent.x;
+      for ( int i = 0 ; i < n && !visited ; i++ )
+      {
+         visited = next.y == cells[ i ].y && next.x == cells[ i ].x;
+      }
+      if ( visited ) break;
+
+      moves[ n ] = best;
+      cells[ n ] = next;
+      n++;
+   }
+
+   return n;
+}
+
+//
+// Epochs between looks at the clock of an anytime learner
+//
+#define QLEARN_CHECK_EPOCHS 1024
+
+static inline uint64_t qlearnNow( void )
+{
+   struct timespec now;
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return ( uint64_t )now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+//
+// Anytime learning: the configured epochs, or fewer if deadline_ns
+// (CLOCK_MONOTONIC, 0 for none) passes first. The table holds the best
+// action learned so far whenever it stops. Returns the epochs run.
+//
+int nhbot_qlearn_until(qlearn_t *q, pos_t *agent, uint64_t deadline_ns)
+{
+   int epochs;
+
+   for (epochs = 0; epochs < qlearnConfig.epochs; epochs++) {
+      if ( deadline_ns && epochs % QLEARN_CHECK_EPOCHS == 0
+        && epochs && qlearnNow() >= deadline_ns ) break;
+      int action = ChooseAgentAction(q, agent, EXPLORE );
+      UpdateAgent(q, agent, action);
    }
+   return epochs;
 }
 #endif
@@ -0,0 +1,197 @@
+#ifndef _QMAP_H_
+#define _QMAP_H_
+
+// Tabular learner over the 5x5 local view (NetHackState.QMap5x5).
+//
+// The state is the hashed tile class pattern around the agent rather
+// than its screen position, so the whole table is a few KB, an epoch
+// touches one row of it, and what is learned on one level still applies
+// on the next.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "qlearn.h"
+
+#define QMAP_BITS   9
+#define QMAP_STATES (1 << QMAP_BITS)
+
+// QVal and QMax share one QMAP_TABLE_SIZE block, heap or checkpoint
+typedef struct qmap {
+    float (*QVal)[ MAX_ACTIONS ];
+    float *QMax;
+    unsigned int seed;
+    double epsilon;
+} qmap_t;
+
+#define QMAP_TABLE_SIZE (sizeof(float) * QMAP_STATES * (MAX_ACTIONS + 1))
+
+// Point a learner at its table
+void qmap_attach(qmap_t *qm, void *table)
+{
+    qm->QVal = table;
+    qm->QMax = (float *)table + QMAP_STATES * MAX_ACTIONS;
+}
+
+// Tile classes of the map with a 2 tile wall border
+typedef uint8_t qmap_tiles_t[ Y_MAX + 4 ][ X_MAX + 4 ];
+
+// Table row of a packed 5x5 pattern
+static inline int qmap_index(uint64_t pattern)
+{
+    return (int)((pattern * 0x9e3779b97f4a7c15ULL) >> (64 - QMAP_BITS));
+}
+
+// Pack a QMap5x5 the same way getLocalPattern() does
+uint64_t qmap_pattern(const int QMap5x5[ 5*5 ])
+{
+    uint64_t pattern = 0;
+    for (int i = 0; i < 5*5; i++) {
+        pattern = (pattern << 2) | (uint64_t)QMap5x5[ i ];
+    }
+    return pattern;
+}
+
+// Classify every tile once, the border makes every 5x5 window in bounds
+void qmap_build_tiles(NetHackState *nethack_state, qmap_tiles_t tiles)
+{
+    memset(tiles, TILE_WALL, sizeof(qmap_tiles_t));
+    for (int y = 0; y < Y_MAX; y++) {
+        for (int x = 0; x < X_MAX; x++) {
+            tiles[ y + 2 ][ x + 2 ] = getTileClass(nethack_state, x, y);
+        }
+    }
+}
+
+// Table row for every screen cell
+void qmap_build_index(qmap_tiles_t tiles, uint16_t index[ Y_MAX ][ X_MAX ])
+{
+    for (int y = 0; y < Y_MAX; y++) {
+        for (int x = 0; x < X_MAX; x++) {
+            uint64_t pattern = 0;
+            for (int dy = 0; dy < 5; dy++) {
+                for (int dx = 0; dx < 5; dx++) {
+                    pattern = (pattern << 2) | tiles[ y + dy ][ x + dx ];
+                }
+            }
+            index[ y ][ x ] = qmap_index(pattern);
+        }
+    }
+}
+
+static inline bool qmap_legal(qmap_tiles_t tiles, int y, int x, int action)
+{
+    return tiles[ y + dir[ action ].y + 2 ][ x + dir[ action ].x + 2 ] != TILE_WALL;
+}
+
+static void qmap_update_max(qmap_t *qm, int s)
+{
+    qm->QMax[ s ] = 0.0f;
+    for (int a = 0; a < MAX_ACTIONS; a++) {
+        if (qm->QVal[ s ][ a ] > qm->QMax[ s ]) {
+            qm->QMax[ s ] = qm->QVal[ s ][ a ];
+        }
+    }
+}
+
+// One Q-learning step from state s to ns, as UpdateAgent() does it
+static inline void qmap_update(qmap_t *qm, int s, int action, float reward,
+                               int ns)
+{
+    qm->QVal[ s ][ action ] += qlearnConfig.learningRate *
+        (reward + qlearnConfig.discountRate * qm->QMax[ ns ]
+                - qm->QVal[ s ][ action ]);
+    qmap_update_max(qm, s);
+}
+
+// Random walk from the player, updating the pattern table, until
+// deadline_ns if it is not 0. Returns the epochs run.
+int nhbot_qmap_learn(qmap_t *qm, NetHackState *nethack_state,
+                     qmap_tiles_t tiles, uint16_t index[ Y_MAX ][ X_MAX ],
+                     uint64_t deadline_ns)
+{
+    static const float tileReward[] = {
+        [TILE_OTHER] =  0.0f,
+        [TILE_FLOOR] =  0.0f,
+        [TILE_WALL]  = -1.0f,
+        [TILE_GOAL]  =  1.0f,
+    };
+    int y = nethack_state->PlayerRow;
+    int x = nethack_state->PlayerCol;
+    int epochs;
+
+    for (epochs = 0; epochs < qlearnConfig.qmapEpochs; epochs++) {
+        if (deadline_ns && epochs && epochs % QLEARN_CHECK_EPOCHS == 0
+         && qlearnNow() >= deadline_ns) {
+            break;
+        }
+        int action = getRand(&qm->seed, qlearnConfig.actions);
+        for (int tries = 0; tries < 8 && !qmap_legal(tiles, y, x, action); tries++) {
+            action = getRand(&qm->seed, qlearnConfig.actions);
+        }
+
+        int ny = y + dir[ action ].y;
+        int nx = x + dir[ action ].x;
+        if (ny < 0 || ny >= Y_MAX || nx < 0 || nx >= X_MAX) {
+            continue;
+        }
+
+        int s = index[ y ][ x ];
+        int ns = index[ ny ][ nx ];
+        float reward = tileReward[ tiles[ ny + 2 ][ nx + 2 ] ];
+
+        qmap_update(qm, s, action, reward, ns);
+
+        if (reward >= 0.0f) {
+            y = ny;
+            x = nx;
+        }
+    }
+    return epochs;
+}
+
+// Legal actions of the player on tiles, bit a for action a
+unsigned nhbot_qmap_legal(NetHackState *nethack_state, qmap_tiles_t tiles)
+{
+    int y = nethack_state->PlayerRow;
+    int x = nethack_state->PlayerCol;
+    unsigned legal = 0;
+
+    for (int a = 0; a < qlearnConfig.actions; a++) {
+        if (qmap_legal(tiles, y, x, a)) {
+            legal |= 1u << a;
+        }
+    }
+    return legal;
+}
+
+// One of the legal actions for the player's QMap5x5, picked by the
+// configured policy
+int nhbot_qmap_choose(qmap_t *qm, NetHackState *nethack_state, unsigned legal)
+{
+    int s = qmap_index(qmap_pattern(nethack_state->QMap5x5));
+    double QVal[ MAX_ACTIONS ];
+
+    for (int a = 0; a < MAX_ACTIONS; a++) {
+        QVal[ a ] = qm->QVal[ s ][ a ];
+    }
+
+    return ChoosePolicyAction(QVal, legal, &qm->epsilon, &qm->seed);
+}
+
+// Learn on the current frame until deadline_ns, 0 for no deadline, and
+// pick the move. *epochs is set to the epochs run and *legal to the
+// legal moves.
+int nhbot_qmap_plan_until(qmap_t *qm, NetHackState *nethack_state,
+                          uint64_t deadline_ns, int *epochs, unsigned *legal)
+{
+    qmap_tiles_t tiles;
+    uint16_t index[ Y_MAX ][ X_MAX ];
+
+    qmap_build_tiles(nethack_state, tiles);
+    qmap_build_index(tiles, index);
+    *epochs = nhbot_qmap_learn(qm, nethack_state, tiles, index, deadline_ns);
+    *legal = nhbot_qmap_legal(nethack_state, tiles);
+    return nhbot_qmap_choose(qm, nethack_state, *legal);
+}
+
+#endif
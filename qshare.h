@@ -0,0 +1,186 @@
+#ifndef _QSHARE_H_
+#define _QSHARE_H_
+
+// Q-values shared by every game, keyed by the 5x5 local view of a cell
+// instead of its screen position, so what one game learns about a
+// corridor or a doorway carries over to the others.
+//
+// The table is split into shards with one lock each. Entries of all
+// shards live in one flat array, a shard owns a contiguous slice of it
+// and probes linearly inside that slice.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "qlearn.h"
+
+#define QSHARE_SHARD_BITS  6
+#define QSHARE_SHARDS      (1 << QSHARE_SHARD_BITS)
+#define QSHARE_SHARD_SLOTS 4096
+#define QSHARE_MAX_PROBE   32
+
+// How far a game pulls the shared value towards its own estimate
+#define QSHARE_MERGE_RATE  0.25
+
+// Set on every key so an all-zero slot is free
+#define QSHARE_KEY_USED    (1ULL << 63)
+
+typedef struct {
+    uint64_t key;
+    uint32_t visits;
+    float QVal[ MAX_ACTIONS ];
+} qshare_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+} qshare_shard_t;
+
+typedef struct qshare {
+    qshare_shard_t shards[QSHARE_SHARDS];
+    qshare_entry_t *entries;
+    uint64_t dropped;
+} qshare_t;
+
+#define QSHARE_TABLE_SIZE \
+    (sizeof(qshare_entry_t) * QSHARE_SHARDS * QSHARE_SHARD_SLOTS)
+
+static inline uint64_t qshare_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Build the table around QSHARE_TABLE_SIZE bytes of entries,
+// zeroed or from a checkpoint
+qshare_t *qshare_new(qshare_entry_t *entries)
+{
+    qshare_t *qs = calloc(1, sizeof(qshare_t));
+    if (!qs) {
+        return NULL;
+    }
+    qs->entries = entries;
+    for (int i = 0; i < QSHARE_SHARDS; i++) {
+        pthread_mutex_init(&qs->shards[i].lock, NULL);
+    }
+    return qs;
+}
+
+// Find the entry for key, inserting it when create is set.
+// Caller holds the shard lock.
+static qshare_entry_t *qshare_slot(qshare_t *qs, int shard, uint64_t hash,
+                                   uint64_t key, bool create)
+{
+    qshare_entry_t *base = qs->entries + (size_t)shard * QSHARE_SHARD_SLOTS;
+
+    for (int i = 0; i < QSHARE_MAX_PROBE; i++) {
+        qshare_entry_t *e = &base[(hash + i) & (QSHARE_SHARD_SLOTS - 1)];
+        if (e->key == key) {
+            return e;
+        }
+        if (e->key == 0) {
+            if (!create) {
+                return NULL;
+            }
+            e->key = key;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Copy the shared values of a local pattern into QVal, false if unknown
+bool qshare_lookup(qshare_t *qs, uint64_t pattern, double QVal[ MAX_ACTIONS ])
+{
+    uint64_t key = pattern | QSHARE_KEY_USED;
+    uint64_t hash = qshare_mix(key);
+    int shard = hash >> (64 - QSHARE_SHARD_BITS);
+    bool found = false;
+
+    pthread_mutex_lock(&qs->shards[shard].lock);
+    qshare_entry_t *e = qshare_slot(qs, shard, hash, key, false);
+    if (e) {
+        for (int a = 0; a < MAX_ACTIONS; a++) {
+            QVal[ a ] = e->QVal[ a ];
+        }
+        found = true;
+    }
+    pthread_mutex_unlock(&qs->shards[shard].lock);
+
+    return found;
+}
+
+// Move the shared values of a local pattern towards a game's estimate
+void qshare_update(qshare_t *qs, uint64_t pattern,
+                   const double QVal[ MAX_ACTIONS ])
+{
+    uint64_t key = pattern | QSHARE_KEY_USED;
+    uint64_t hash = qshare_mix(key);
+    int shard = hash >> (64 - QSHARE_SHARD_BITS);
+
+    pthread_mutex_lock(&qs->shards[shard].lock);
+    qshare_entry_t *e = qshare_slot(qs, shard, hash, key, true);
+    if (e) {
+        double rate = e->visits ? QSHARE_MERGE_RATE : 1.0;
+        for (int a = 0; a < MAX_ACTIONS; a++) {
+            e->QVal[ a ] += rate * (QVal[ a ] - e->QVal[ a ]);
+        }
+        e->visits++;
+    } else {
+        __atomic_add_fetch(&qs->dropped, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&qs->shards[shard].lock);
+}
+
+// Is this cell somewhere the agent can stand
+static inline bool qshare_cell_walkable(int tile)
+{
+    return tile == TILE_FLOOR || tile == TILE_GOAL;
+}
+
+// Seed a game's table from what all games have learned so far
+void qshare_seed(qshare_t *qs, qlearn_t *q, uint64_t patterns[ Y_MAX ][ X_MAX ])
+{
+    for (int y = 0; y < Y_MAX; y++) {
+        for (int x = 0; x < X_MAX; x++) {
+            stateAction_t *sa = &q->stateSpace[ y ][ x ];
+            patterns[ y ][ x ] = 0;
+            if (!qshare_cell_walkable(getEnv(q, y, x))) {
+                continue;
+            }
+            patterns[ y ][ x ] = getLocalPattern(q, y, x);
+            if (qshare_lookup(qs, patterns[ y ][ x ], sa->QVal)) {
+                CalculateMaxQ(q, y, x);
+            }
+        }
+    }
+}
+
+// Fold a game's learned values back into the shared table
+void qshare_merge(qshare_t *qs, qlearn_t *q,
+                  uint64_t patterns[ Y_MAX ][ X_MAX ])
+{
+    for (int y = 0; y < Y_MAX; y++) {
+        for (int x = 0; x < X_MAX; x++) {
+            if (patterns[ y ][ x ]) {
+                qshare_update(qs, patterns[ y ][ x ],
+                              q->stateSpace[ y ][ x ].QVal);
+            }
+        }
+    }
+}
+
+// Number of distinct local patterns stored, call with workers idle
+uint64_t qshare_size(qshare_t *qs)
+{
+    uint64_t used = 0;
+    for (size_t i = 0; i < (size_t)QSHARE_SHARDS * QSHARE_SHARD_SLOTS; i++) {
+        used += qs->entries[i].key != 0;
+    }
+    return used;
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef _REWARD_H_
+#define _REWARD_H_
+
+// Reward from the bottom line.
+//
+// The glyph rewards in qlearn.h only score the simulated walks. What a
+// move really earned shows up in the status lines: gold picked up,
+// levels descended, experience, HP lost and turns spent. The io loop
+// folds every new bottom line into the pending deltas, but only on
+// frames that redrew a status row, and the learner takes them when it
+// plans its next move.
+
+#include <stdint.h>
+#include "nhbot.h"
+
+// Rows holding the bottom line
+#define REWARD_STATUS_ROWS ((1ULL << (VT_H - 2)) | (1ULL << (VT_H - 1)))
+
+#define REWARD_GOLD   0.01f    // per zorkmid
+#define REWARD_DEPTH  1.0f     // per level descended
+#define REWARD_XP     0.5f     // per experience level
+#define REWARD_HP     0.05f    // per hit point lost
+#define REWARD_TURN   0.001f   // per game turn
+
+typedef struct {
+    int32_t Money;
+    int32_t Dlvl;
+    int32_t Xp;
+    int32_t HP;
+    int32_t T;
+} reward_delta_t;
+
+typedef struct reward {
+    NetHackBlStat last;
+    bool valid;
+    reward_delta_t pending;
+} reward_t;
+
+static inline float reward_value(const reward_delta_t *d)
+{
+    float r = REWARD_GOLD * d->Money
+            + REWARD_DEPTH * d->Dlvl
+            + REWARD_XP * d->Xp;
+
+    if (d->HP < 0) {
+        r += REWARD_HP * d->HP;
+    }
+    if (d->T > 0) {
+        r -= REWARD_TURN * d->T;
+    }
+    return r;
+}
+
+// Add the change from the last bottom line to the pending deltas
+void reward_update(reward_t *r, const NetHackBlStat *bl)
+{
+    // Every stat reads 0 until the status lines are drawn
+    if (bl->Dlvl == 0) {
+        return;
+    }
+    if (r->valid) {
+        r->pending.Money += (int32_t)(bl->Money - r->last.Money);
+        r->pending.Dlvl += (int32_t)(bl->Dlvl - r->last.Dlvl);
+        r->pending.Xp += (int32_t)(bl->Xp - r->last.Xp);
+        r->pending.HP += (int32_t)(bl->HP - r->last.HP);
+        r->pending.T += (int32_t)(bl->T - r->last.T);
+    }
+    r->last = *bl;
+    r->valid = true;
+}
+
+// Reward earned since the last call
+float reward_take(reward_t *r)
+{
+    float value = reward_value(&r->pending);
+    r->pending = (reward_delta_t){0};
+    return value;
+}
+
+// A new game, its first bottom line is not a change
+void reward_reset(reward_t *r)
+{
+    *r = (reward_t){0};
+}
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+// Work-stealing thread pool for per-game planning tasks.
+//
+// Every worker owns a queue. Tasks are pushed to a "home" worker
+// (normally game id % nworkers) so a game tends to stay on one core,
+// and a worker whose queue runs dry steals the oldest task from the
+// other queues. Submission happens from the single-threaded I/O reactor.
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef void (*sched_fn_t)(void *arg);
+
+typedef struct {
+    sched_fn_t fn;
+    void *arg;
+} sched_task_t;
+
+// Ring buffer of tasks, popped from the top by owner and thieves alike
+// so the oldest waiting game is always served first
+typedef struct {
+    pthread_mutex_t lock;
+    size_t top;
+    size_t bottom;
+    size_t mask;
+    sched_task_t *tasks;
+} sched_deque_t;
+
+typedef struct sched {
+    int nworkers;
+    pthread_t *threads;
+    sched_deque_t *deques;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t idle_cond;
+    size_t queued;
+    size_t active;
+    bool stop;
+
+    uint64_t executed;
+    uint64_t steals;
+} sched_t;
+
+struct sched_worker_arg {
+    sched_t *sched;
+    int id;
+};
+
+static bool sched_deque_push(sched_deque_t *d, sched_task_t task)
+{
+    bool pushed = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom - d->top <= d->mask) {
+        d->tasks[d->bottom++ & d->mask] = task;
+        pushed = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return pushed;
+}
+
+static bool sched_deque_pop(sched_deque_t *d, sched_task_t *task)
+{
+    bool popped = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->top != d->bottom) {
+        *task = d->tasks[d->top++ & d->mask];
+        popped = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return popped;
+}
+
+// Take a task from our own queue, otherwise steal from the others
+static bool sched_next_task(sched_t *s, int id, sched_task_t *task)
+{
+    if (sched_deque_pop(&s->deques[id], task)) {
+        return true;
+    }
+    for (int i = 1; i < s->nworkers; i++) {
+        int victim = (id + i) % s->nworkers;
+        if (sched_deque_pop(&s->deques[victim], task)) {
+            __atomic_add_fetch(&s->steals, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *sched_worker(void *p)
+{
+    struct sched_worker_arg *arg = p;
+    sched_t *s = arg->sched;
+    int id = arg->id;
+    sched_task_t task;
+
+    free(arg);
+
+    for (;;) {
+        if (sched_next_task(s, id, &task)) {
+            pthread_mutex_lock(&s->lock);
+            s->queued--;
+            pthread_mutex_unlock(&s->lock);
+
+            task.fn(task.arg);
+
+            pthread_mutex_lock(&s->lock);
+            s->executed++;
+            if (--s->active == 0) {
+                pthread_cond_broadcast(&s->idle_cond);
+            }
+            pthread_mutex_unlock(&s->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        while (s->queued == 0 && !s->stop) {
+            pthread_cond_wait(&s->work_cond, &s->lock);
+        }
+        if (s->stop && s->queued == 0) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return NULL;
+}
+
+// Start nworkers threads, each able to hold max_tasks queued tasks
+int sched_init(sched_t *s, int nworkers, size_t max_tasks)
+{
+    size_t cap = 1;
+
+    while (cap < max_tasks) {
+        cap <<= 1;
+    }
+
+    *s = (sched_t){0};
+    s->nworkers = nworkers;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work_cond, NULL);
+    pthread_cond_init(&s->idle_cond, NULL);
+
+    if (!(s->threads = calloc(nworkers, sizeof(pthread_t)))) {
+        return -1;
+    }
+    if (!(s->deques = calloc(nworkers, sizeof(sched_deque_t)))) {
+        return -1;
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        sched_deque_t *d = &s->deques[i];
+        pthread_mutex_init(&d->lock, NULL);
+        d->mask = cap - 1;
+        if (!(d->tasks = calloc(cap, sizeof(sched_task_t)))) {
+            return -1;
+        }
+    }
+
+    // Workers inherit a blocked signal mask, signals go to the io loop
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for (int i = 0; i < nworkers; i++) {
+        struct sched_worker_arg *arg = malloc(sizeof(*arg));
+        if (!arg) {
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+            return -1;
+        }
+        arg->sched = s;
+        arg->id = i;
+        if (pthread_create(&s->threads[i], NULL, sched_worker, arg) != 0) {
+            free(arg);
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+            return -1;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return 0;
+}
+
+// Queue a task on its home worker, any idle worker may steal it
+int sched_submit(sched_t *s, int home, sched_fn_t fn, void *arg)
+{
+    sched_task_t task = { fn, arg };
+    int start = home % s->nworkers;
+
+    pthread_mutex_lock(&s->lock);
+    s->queued++;
+    s->active++;
+    pthread_mutex_unlock(&s->lock);
+
+    for (int i = 0; i < s->nworkers; i++) {
+        if (sched_deque_push(&s->deques[(start + i) % s->nworkers], task)) {
+            pthread_mutex_lock(&s->lock);
+            pthread_cond_signal(&s->work_cond);
+            pthread_mutex_unlock(&s->lock);
+            return 0;
+        }
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->queued--;
+    s->active--;
+    pthread_mutex_unlock(&s->lock);
+    return -1;
+}
+
+// Block until every submitted task has finished
+void sched_wait_idle(sched_t *s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->active != 0) {
+        pthread_cond_wait(&s->idle_cond, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Drain the queues and join the workers
+void sched_shutdown(sched_t *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->stop = true;
+    pthread_cond_broadcast(&s->work_cond);
+    pthread_mutex_unlock(&s->lock);
+
+    for (int i = 0; i < s->nworkers; i++) {
+        pthread_join(s->threads[i], NULL);
+    }
+    for (int i = 0; i < s->nworkers; i++) {
+        free(s->deques[i].tasks);
+    }
+    free(s->deques);
+    free(s->threads);
+}
+
+#endif
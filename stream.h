@@ -0,0 +1,315 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+// Spectator streaming over a Unix socket.
+//
+// A viewer connects to the socket and is subscribed to game 0. Writing
+// a game id followed by a newline switches to that game. Every message
+// is a frame:
+//
+//   u8 'N' | u8 type (0 delta, 1 key) | u16 game | u32 frame | u16 nruns
+//
+// followed by nruns records of 5 bytes, each a run of identical cells:
+//
+//   u8 row | u8 col | u8 count | u8 char | u8 color
+//
+// Integers are little endian. Rows and columns are those of the game's
+// terminal, 80x24 unless nhbot was started with -V. A key frame covers the whole screen and
+// is sent on subscribe; after that only cells on dirty lines that
+// changed since the last frame are sent. A viewer that cannot keep up
+// is disconnected instead of buffering without bound or blocking the io
+// loop.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "nhbot.h"
+
+#define STREAM_MAX_CLIENTS 32
+#define STREAM_BUF_MAX     (64 * 1024)
+#define STREAM_MAGIC       'N'
+#define STREAM_HDR_LEN     10
+#define STREAM_RUN_LEN     5
+#define STREAM_FRAME_MAX   (STREAM_HDR_LEN + STREAM_RUN_LEN * VT_W_MAX * VT_H_MAX)
+
+typedef enum {
+    STREAM_DELTA = 0,
+    STREAM_KEY,
+} StreamFrameType;
+
+typedef struct {
+    int fd;
+    int game;
+    bool keyframe;
+    size_t inlen;
+    char in[16];
+    size_t len;
+    uint8_t buf[STREAM_BUF_MAX];
+} stream_client_t;
+
+typedef struct {
+    uint8_t ScreenChar[VT_W_MAX*VT_H_MAX];
+    uint8_t ScreenColor[VT_W_MAX*VT_H_MAX];
+} stream_shadow_t;
+
+typedef struct {
+    int listen_fd;
+    const char *path;
+    int ngames;
+    stream_shadow_t *shadow;
+    stream_client_t *clients[STREAM_MAX_CLIENTS];
+    uint64_t dropped;
+} stream_t;
+
+// Listen on path for viewers of ngames games
+int stream_open(stream_t *st, const char *path, int ngames)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    *st = (stream_t){ .listen_fd = -1, .path = path, .ngames = ngames };
+    check(strlen(path) < sizeof(addr.sun_path));
+    strcpy(addr.sun_path, path);
+    check((st->shadow = calloc(ngames, sizeof(stream_shadow_t))));
+
+    check((st->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK
+                                  | SOCK_CLOEXEC, 0)) != -1);
+    unlink(path);
+    check(bind(st->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != -1);
+    check(listen(st->listen_fd, STREAM_MAX_CLIENTS) != -1);
+
+    return 0;
+
+error:
+    return -1;
+}
+
+static void stream_drop(stream_t *st, int i)
+{
+    close(st->clients[i]->fd);
+    free(st->clients[i]);
+    st->clients[i] = NULL;
+}
+
+// Flush pending output, false if the viewer is gone
+static bool stream_flush(stream_client_t *cl)
+{
+    while (cl->len) {
+        ssize_t n = send(cl->fd, cl->buf, cl->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        memmove(cl->buf, cl->buf + n, cl->len - n);
+        cl->len -= n;
+    }
+    return true;
+}
+
+// Queue a frame for a viewer, drop the viewer if it is too far behind
+static void stream_send(stream_t *st, int i, const uint8_t *msg, size_t len)
+{
+    stream_client_t *cl = st->clients[i];
+
+    if (!stream_flush(cl) || cl->len + len > STREAM_BUF_MAX) {
+        st->dropped++;
+        stream_drop(st, i);
+        return;
+    }
+    memcpy(cl->buf + cl->len, msg, len);
+    cl->len += len;
+    if (!stream_flush(cl)) {
+        stream_drop(st, i);
+    }
+}
+
+// Encode the cells of the rows set in mask. With a shadow, the screen
+// last sent, only cells that differ from it are encoded.
+static size_t stream_encode(uint8_t *out, StreamFrameType type, int game,
+                            NetHackState *nethack_state, uint64_t rows,
+                            stream_shadow_t *shadow)
+{
+    size_t len = STREAM_HDR_LEN;
+    uint16_t nruns = 0;
+    uint32_t frame = nethack_state->FrameCount;
+
+    for (int r = 0; r < nethack_state->Rows; r++) {
+        if (!(rows & (1ULL << r))) {
+            continue;
+        }
+        for (int c = 0; c < nethack_state->Cols; ) {
+            int i = screen_index(nethack_state, r, c);
+            uint8_t ch = nethack_state->ScreenChar[i];
+            uint8_t color = nethack_state->ScreenColor[i];
+
+            if (shadow && shadow->ScreenChar[i] == ch
+                       && shadow->ScreenColor[i] == color) {
+                c++;
+                continue;
+            }
+
+            int count = 0;
+            while (c + count < nethack_state->Cols
+                && nethack_state->ScreenChar[i + count] == ch
+                && nethack_state->ScreenColor[i + count] == color
+                && (!shadow || shadow->ScreenChar[i + count] != ch
+                            || shadow->ScreenColor[i + count] != color)) {
+                count++;
+            }
+
+            out[len++] = r;
+            out[len++] = c;
+            out[len++] = count;
+            out[len++] = ch;
+            out[len++] = color;
+            nruns++;
+            c += count;
+        }
+    }
+
+    out[0] = STREAM_MAGIC;
+    out[1] = type;
+    out[2] = game & 0xff;
+    out[3] = game >> 8;
+    out[4] = frame & 0xff;
+    out[5] = (frame >> 8) & 0xff;
+    out[6] = (frame >> 16) & 0xff;
+    out[7] = frame >> 24;
+    out[8] = nruns & 0xff;
+    out[9] = nruns >> 8;
+    return len;
+}
+
+void stream_fdset(stream_t *st, fd_set *readable, int *maxfd)
+{
+    FD_SET(st->listen_fd, readable);
+    if (st->listen_fd > *maxfd) {
+        *maxfd = st->listen_fd;
+    }
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        if (st->clients[i]) {
+            FD_SET(st->clients[i]->fd, readable);
+            if (st->clients[i]->fd > *maxfd) {
+                *maxfd = st->clients[i]->fd;
+            }
+        }
+    }
+}
+
+// Accept viewers and read their subscriptions
+void stream_poll(stream_t *st, fd_set *readable)
+{
+    if (FD_ISSET(st->listen_fd, readable)) {
+        int fd;
+        while ((fd = accept4(st->listen_fd, NULL, NULL,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+            int i;
+            for (i = 0; i < STREAM_MAX_CLIENTS && st->clients[i]; i++);
+            if (i == STREAM_MAX_CLIENTS || fd >= FD_SETSIZE
+             || !(st->clients[i] = calloc(1, sizeof(stream_client_t)))) {
+                close(fd);
+                continue;
+            }
+            st->clients[i]->fd = fd;
+            st->clients[i]->keyframe = true;
+        }
+    }
+
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        stream_client_t *cl = st->clients[i];
+        if (!cl || !FD_ISSET(cl->fd, readable)) {
+            continue;
+        }
+
+        char c;
+        ssize_t n;
+        while ((n = read(cl->fd, &c, 1)) == 1) {
+            if (c != '\n') {
+                if (cl->inlen < sizeof(cl->in) - 1) {
+                    cl->in[cl->inlen++] = c;
+                }
+                continue;
+            }
+            cl->in[cl->inlen] = '\0';
+            cl->inlen = 0;
+            int game = atoi(cl->in);
+            if (game >= 0 && game < st->ngames) {
+                cl->game = game;
+                cl->keyframe = true;
+            }
+        }
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            stream_drop(st, i);
+        }
+    }
+}
+
+// Send every viewer what changed in its game
+void stream_publish(stream_t *st, struct io_params *games)
+{
+    static uint8_t msg[STREAM_FRAME_MAX];
+
+    for (int g = 0; g < st->ngames; g++) {
+        NetHackState *nethack_state = games[g].nethack_state;
+        uint64_t all_rows = nethack_state->Rows == 64
+                          ? ~0ULL : ((1ULL << nethack_state->Rows) - 1);
+        size_t len = 0;
+        bool watched = false;
+
+        for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+            if (st->clients[i] && st->clients[i]->game == g) {
+                watched = true;
+            }
+        }
+        if (!watched) {
+            continue;
+        }
+
+        if (nethack_state->DirtyRows) {
+            len = stream_encode(msg, STREAM_DELTA, g, nethack_state,
+                                nethack_state->DirtyRows, &st->shadow[g]);
+        }
+        for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+            stream_client_t *cl = st->clients[i];
+            if (!cl || cl->game != g || cl->keyframe || len <= STREAM_HDR_LEN) {
+                continue;
+            }
+            stream_send(st, i, msg, len);
+        }
+
+        // New subscribers get the whole screen
+        for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+            stream_client_t *cl = st->clients[i];
+            if (!cl || cl->game != g || !cl->keyframe) {
+                continue;
+            }
+            size_t keylen = stream_encode(msg, STREAM_KEY, g, nethack_state,
+                                          all_rows, NULL);
+            cl->keyframe = false;
+            stream_send(st, i, msg, keylen);
+        }
+        // The shadow now matches the screen even if no delta was sent
+        memcpy(st->shadow[g].ScreenChar, nethack_state->ScreenChar,
+               sizeof(nethack_state->ScreenChar));
+        memcpy(st->shadow[g].ScreenColor, nethack_state->ScreenColor,
+               sizeof(nethack_state->ScreenColor));
+    }
+}
+
+void stream_close(stream_t *st)
+{
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        if (st->clients[i]) {
+            stream_drop(st, i);
+        }
+    }
+    if (st->listen_fd != -1) {
+        close(st->listen_fd);
+        unlink(st->path);
+    }
+}
+
+#endif
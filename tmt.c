@@ -36,7 +36,17 @@
 #define TAB 8
 #define MAX(x, y) (((size_t)(x) > (size_t)(y)) ? (size_t)(x) : (size_t)(y))
 #define MIN(x, y) (((size_t)(x) < (size_t)(y)) ? (size_t)(x) : (size_t)(y))
-#define CLINE(vt) (vt)->screen.lines[MIN((vt)->curs.r, (vt)->screen.nline - 1)]
+#define CLINE(vt) tmt_line(&(vt)->screen, MIN((vt)->curs.r, (vt)->screen.nline - 1))
+
+/* What a scroll moves: line pointers, or row numbers of a fixed screen */
+#ifdef TMT_FIXED
+typedef unsigned short ROW;
+#define ROWS(vt) ((vt)->screen.row)
+#define ALIGNUP(x) (((x) + TMT_ALIGN - 1) / TMT_ALIGN * TMT_ALIGN)
+#else
+typedef TMTLINE *ROW;
+#define ROWS(vt) ((vt)->screen.lines)
+#endif
 
 #define P0(x) (vt->pars[x])
 #define P1(x) (vt->pars[x]? vt->pars[x] : 1)
@@ -71,6 +81,10 @@ struct TMT {
     size_t npar;
     size_t arg;
     enum {S_NUL, S_ESC, S_ARG} state;
+
+#ifdef TMT_FIXED
+    bool owned;
+#endif
 };
 
 static TMTATTRS defattrs = {.fg = TMT_COLOR_DEFAULT, .bg = TMT_COLOR_DEFAULT};
@@ -97,7 +111,7 @@ dirtylines(TMT *vt, size_t s, size_t e)
 {
     vt->dirty = true;
     for (size_t i = s; i < e; i++)
-        vt->screen.lines[i]->dirty = true;
+        tmt_line(&vt->screen, i)->dirty = true;
 }
 
 static void
@@ -114,7 +128,7 @@ static void
 clearlines(TMT *vt, size_t r, size_t n)
 {
     for (size_t i = r; i < r + n && i < vt->screen.nline; i++)
-        clearline(vt, vt->screen.lines[i], 0, vt->screen.ncol);
+        clearline(vt, tmt_line(&vt->screen, i), 0, vt->screen.ncol);
 }
 
 static void
@@ -123,13 +137,13 @@ scrup(TMT *vt, size_t r, size_t n)
     n = MIN(n, vt->screen.nline - 1 - r);
 
     if (n) {
-        TMTLINE *buf[n];
+        ROW buf[n];
 
-        memcpy(buf, vt->screen.lines + r, n * sizeof(TMTLINE *));
-        memmove(vt->screen.lines + r, vt->screen.lines + r + n,
-                (vt->screen.nline - n - r) * sizeof(TMTLINE *));
-        memcpy(vt->screen.lines + (vt->screen.nline - n),
-               buf, n * sizeof(TMTLINE *));
+        memcpy(buf, ROWS(vt) + r, n * sizeof(ROW));
+        memmove(ROWS(vt) + r, ROWS(vt) + r + n,
+                (vt->screen.nline - n - r) * sizeof(ROW));
+        memcpy(ROWS(vt) + (vt->screen.nline - n),
+               buf, n * sizeof(ROW));
 
         clearlines(vt, vt->screen.nline - n, n);
         dirtylines(vt, r, vt->screen.nline);
@@ -142,13 +156,13 @@ scrdn(TMT *vt, size_t r, size_t n)
     n = MIN(n, vt->screen.nline - 1 - r);
 
     if (n) {
-        TMTLINE *buf[n];
+        ROW buf[n];
 
-        memcpy(buf, vt->screen.lines + (vt->screen.nline - n),
-               n * sizeof(TMTLINE *));
-        memmove(vt->screen.lines + r + n, vt->screen.lines + r,
-                (vt->screen.nline - n - r) * sizeof(TMTLINE *));
-        memcpy(vt->screen.lines + r, buf, n * sizeof(TMTLINE *));
+        memcpy(buf, ROWS(vt) + (vt->screen.nline - n),
+               n * sizeof(ROW));
+        memmove(ROWS(vt) + r + n, ROWS(vt) + r,
+                (vt->screen.nline - n - r) * sizeof(ROW));
+        memcpy(ROWS(vt) + r, buf, n * sizeof(ROW));
 
         clearlines(vt, r, n);
         dirtylines(vt, r, vt->screen.nline);
@@ -389,6 +403,78 @@ notify(TMT *vt, bool update, bool moved)
     if (moved) CB(vt, TMT_MSG_MOVED, &vt->curs);
 }
 
+#ifdef TMT_FIXED
+/* The block: the TMT, row numbers, the tab stops line and the lines,
+ * each part starting on a TMT_ALIGN boundary.
+ */
+size_t
+tmt_size(size_t nline, size_t ncol)
+{
+    size_t linesize = ALIGNUP(sizeof(TMTLINE) + ncol * sizeof(TMTCHAR));
+    return ALIGNUP(sizeof(TMT)) + ALIGNUP(nline * sizeof(ROW))
+         + (nline + 1) * linesize;
+}
+
+TMT *
+tmt_open_in(void *mem, size_t nline, size_t ncol, TMTCALLBACK cb, void *p,
+            const wchar_t *acs)
+{
+    TMT *vt = mem;
+    unsigned char *b = mem;
+
+    if (nline < 2 || ncol < 2 || nline > (ROW)-1 || !vt) return NULL;
+    memset(mem, 0, tmt_size(nline, ncol));
+
+    vt->acschars = acs? acs : L"><^v#+:o##+++++~---_++++|<>*!fo";
+    vt->cb = cb;
+    vt->p = p;
+
+    vt->screen.nline = nline;
+    vt->screen.ncol = ncol;
+    vt->screen.linesize = ALIGNUP(sizeof(TMTLINE) + ncol * sizeof(TMTCHAR));
+    vt->screen.row = (ROW *)(b + ALIGNUP(sizeof(TMT)));
+    vt->tabs = (TMTLINE *)(b + ALIGNUP(sizeof(TMT)) + ALIGNUP(nline * sizeof(ROW)));
+    vt->screen.block = (unsigned char *)vt->tabs + vt->screen.linesize;
+    for (size_t i = 0; i < nline; i++)
+        vt->screen.row[i] = (ROW)i;
+
+    clearlines(vt, 0, nline);
+    clearline(vt, vt->tabs, 0, ncol);
+    vt->tabs->chars[0].c = vt->tabs->chars[ncol - 1].c = L'*';
+    for (size_t i = 0; i < ncol; i++) if (i % TAB == 0)
+            vt->tabs->chars[i].c = L'*';
+
+    dirtylines(vt, 0, nline);
+    notify(vt, true, true);
+    return vt;
+}
+
+TMT *
+tmt_open(size_t nline, size_t ncol, TMTCALLBACK cb, void *p,
+         const wchar_t *acs)
+{
+    size_t size = tmt_size(nline, ncol);
+    void *mem = aligned_alloc(TMT_ALIGN, size);
+    TMT *vt = tmt_open_in(mem, nline, ncol, cb, p, acs);
+
+    if (!vt) return free(mem), NULL;
+    vt->owned = true;
+    return vt;
+}
+
+void
+tmt_close(TMT *vt)
+{
+    if (vt->owned) free(vt);
+}
+
+/* The size is fixed, only asking for the same one succeeds */
+bool
+tmt_resize(TMT *vt, size_t nline, size_t ncol)
+{
+    return nline == vt->screen.nline && ncol == vt->screen.ncol;
+}
+#else
 static TMTLINE *
 allocline(TMT *vt, TMTLINE *o, size_t n, size_t pc)
 {
@@ -469,6 +555,7 @@ tmt_resize(TMT *vt, size_t nline, size_t ncol)
     notify(vt, true, true);
     return true;
 }
+#endif
 
 static void
 writecharatcurs(TMT *vt, wchar_t w)
@@ -561,7 +648,7 @@ void
 tmt_clean(TMT *vt)
 {
     for (size_t i = 0; i < vt->screen.nline; i++)
-        vt->dirty = vt->screen.lines[i]->dirty = false;
+        vt->dirty = tmt_line(&vt->screen, i)->dirty = false;
 }
 
 void
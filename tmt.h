@@ -107,14 +107,35 @@ struct TMTLINE {
     TMTCHAR chars[];
 };
 
+/* With TMT_FIXED the size is set once at open and the screen is one
+ * block: line slots of linesize bytes, and row[] giving the slot of
+ * each row, so a scroll moves row numbers instead of lines. Reach
+ * lines with tmt_line() in either build.
+ */
 typedef struct TMTSCREEN TMTSCREEN;
 struct TMTSCREEN {
     size_t nline;
     size_t ncol;
 
+#ifdef TMT_FIXED
+    size_t linesize;
+    unsigned char *block;
+    unsigned short *row;
+#else
     TMTLINE **lines;
+#endif
 };
 
+static inline TMTLINE *
+tmt_line(const TMTSCREEN *s, size_t r)
+{
+#ifdef TMT_FIXED
+    return (TMTLINE *)(s->block + s->row[r] * s->linesize);
+#else
+    return s->lines[r];
+#endif
+}
+
 /**** CALLBACK SUPPORT */
 typedef enum {
     TMT_MSG_MOVED,
@@ -137,4 +158,16 @@ const TMTPOINT *tmt_cursor(const TMT *vt);
 void tmt_clean(TMT *vt);
 void tmt_reset(TMT *vt);
 
+#ifdef TMT_FIXED
+/* Bytes a terminal of nline by ncol takes, a multiple of TMT_ALIGN. */
+#define TMT_ALIGN 64
+size_t tmt_size(size_t nline, size_t ncol);
+
+/* Open a terminal in mem, tmt_size() bytes aligned to TMT_ALIGN, so
+ * many can share one arena. tmt_close() leaves mem to the caller.
+ */
+TMT *tmt_open_in(void *mem, size_t nline, size_t ncol, TMTCALLBACK cb,
+                 void *p, const wchar_t *acs);
+#endif
+
 #endif
@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nhbot.h"
+#include "ckpt.h"
+#include "config.h"
+#include "qlearn.h"
+#include "qmap.h"
+#include "reward.h"
+#include "sched.h"
+#include "traj.h"
+
+// Offline trainer. Replays trajectory logs written by nhbot -T into the
+// qmap learner and saves a checkpoint nhbot -L qmap -C can start from.
+//
+// Episodes are split across the workers, each replays its share into a
+// private copy of the table, and the copies are merged weighted by how
+// often each state/action was updated.
+
+// One episode, its records in step order
+typedef struct {
+    const traj_record_t **steps;
+    size_t len;
+} train_episode_t;
+
+// A worker's share of the episodes and its private table
+typedef struct {
+    qmap_t qm;
+    uint32_t (*visits)[ MAX_ACTIONS ];
+    const train_episode_t *episodes;
+    size_t nepisodes;
+    int part;
+    int nparts;
+    int passes;
+    uint64_t updates;
+} train_part_t;
+
+// Sort key of a record, its episode is (run, game, episode)
+typedef struct {
+    uint32_t run;
+    const traj_record_t *rec;
+} train_ref_t;
+
+static int train_ref_cmp(const void *a, const void *b)
+{
+    const train_ref_t *x = a;
+    const train_ref_t *y = b;
+
+    if (x->run != y->run) {
+        return x->run < y->run ? -1 : 1;
+    }
+    if (x->rec->game != y->rec->game) {
+        return x->rec->game < y->rec->game ? -1 : 1;
+    }
+    if (x->rec->episode != y->rec->episode) {
+        return x->rec->episode < y->rec->episode ? -1 : 1;
+    }
+    if (x->rec->step != y->rec->step) {
+        return x->rec->step < y->rec->step ? -1 : 1;
+    }
+    return 0;
+}
+
+static bool train_same_episode(const train_ref_t *a, const train_ref_t *b)
+{
+    return a->run == b->run && a->rec->game == b->rec->game
+        && a->rec->episode == b->rec->episode;
+}
+
+static int train_state(const traj_record_t *rec)
+{
+    int QMap5x5[ 5*5 ];
+    for (int i = 0; i < 5*5; i++) {
+        QMap5x5[ i ] = rec->QMap5x5[ i ];
+    }
+    return qmap_index(qmap_pattern(QMap5x5));
+}
+
+// Learner action of a logged move, -1 if it was not a move
+static int train_action(const traj_record_t *rec)
+{
+    for (int a = 0; a < MAX_ACTIONS; a++) {
+        if (dirMove[ a ] == rec->action) {
+            return a;
+        }
+    }
+    return -1;
+}
+
+// What the move from prev to rec earned
+static float train_reward(const traj_record_t *prev, const traj_record_t *rec)
+{
+    reward_delta_t d = {
+        .Money = rec->dMoney,
+        .Dlvl = rec->dDlvl,
+        .Xp = rec->dXp,
+        .HP = rec->dHP,
+        .T = prev->BlStat.Dlvl ? (int32_t)(rec->BlStat.T - prev->BlStat.T) : 0,
+    };
+    return reward_value(&d);
+}
+
+// Worker task, replay every nparts-th episode
+static void train_replay(void *arg)
+{
+    train_part_t *p = arg;
+
+    for (int pass = 0; pass < p->passes; pass++) {
+        for (size_t e = p->part; e < p->nepisodes; e += p->nparts) {
+            const train_episode_t *ep = &p->episodes[ e ];
+            for (size_t t = 0; t + 1 < ep->len; t++) {
+                int action = train_action(ep->steps[ t ]);
+                if (action == -1) {
+                    continue;
+                }
+                int s = train_state(ep->steps[ t ]);
+                int ns = train_state(ep->steps[ t + 1 ]);
+                qmap_update(&p->qm, s, action,
+                            train_reward(ep->steps[ t ], ep->steps[ t + 1 ]),
+                            ns);
+                p->visits[ s ][ action ]++;
+                p->updates++;
+            }
+        }
+    }
+}
+
+// Average the worker tables into out, weighted by visits. Pairs no
+// worker touched keep the starting value.
+static void train_merge(qmap_t *out, train_part_t *parts, int nparts)
+{
+    for (int s = 0; s < QMAP_STATES; s++) {
+        for (int a = 0; a < MAX_ACTIONS; a++) {
+            double sum = 0.0;
+            uint64_t n = 0;
+            for (int i = 0; i < nparts; i++) {
+                sum += (double)parts[ i ].visits[ s ][ a ]
+                     * parts[ i ].qm.QVal[ s ][ a ];
+                n += parts[ i ].visits[ s ][ a ];
+            }
+            if (n) {
+                out->QVal[ s ][ a ] = (float)(sum / n);
+            }
+        }
+        qmap_update_max(out, s);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s -o checkpoint [-i checkpoint] [-j workers] [-e passes]\n"
+            "       [-n games] [-c config] log.traj...\n"
+            "  -o path     checkpoint to write\n"
+            "  -i path     checkpoint to start from (its qmap table of game 0)\n"
+            "  -j workers  replay threads (default: online cpus)\n"
+            "  -e passes   times every episode is replayed (default 10)\n"
+            "  -n games    games of nhbot the table is written for (default 1)\n"
+            "  -c path     learner settings, as for nhbot -c (learning_rate,\n"
+            "              discount)\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *out_path = NULL;
+    const char *in_path = NULL;
+    int workers = 0;
+    int passes = 10;
+    int ngames = 1;
+    int opt;
+
+    traj_file_t *files = NULL;
+    train_ref_t *refs = NULL;
+    const traj_record_t **steps = NULL;
+    train_episode_t *episodes = NULL;
+    train_part_t *parts = NULL;
+    ckpt_blob_t *blobs = NULL;
+    void *table = NULL;
+    size_t nrefs = 0;
+    size_t nepisodes = 0;
+    uint64_t updates = 0;
+    ckpt_map_t start;
+    qmap_t merged;
+    sched_t sched;
+    struct timespec t0, t1;
+
+    while ((opt = getopt(argc, argv, "o:i:j:e:n:c:h")) != -1) {
+        switch (opt) {
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'i':
+            in_path = optarg;
+            break;
+        case 'j':
+            workers = atoi(optarg);
+            break;
+        case 'e':
+            passes = atoi(optarg);
+            break;
+        case 'n':
+            ngames = atoi(optarg);
+            break;
+        case 'c':
+            if (config_load(optarg) == -1) {
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!out_path || optind == argc || passes < 1 || ngames < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (workers < 1) {
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+
+    // Map every log and collect its records
+    check((files = calloc(argc - optind, sizeof(traj_file_t))));
+    for (int i = optind; i < argc; i++) {
+        if (traj_map(&files[ i - optind ], argv[ i ]) == -1) {
+            fprintf(stderr, "nhbot-train: %s: not a trajectory log, skipped\n",
+                    argv[ i ]);
+            continue;
+        }
+        nrefs += files[ i - optind ].header->count;
+    }
+    check(nrefs > 0);
+    check((refs = calloc(nrefs, sizeof(train_ref_t))));
+    nrefs = 0;
+    for (int i = 0; i < argc - optind; i++) {
+        for (uint64_t r = 0; files[ i ].header && r < files[ i ].header->count; r++) {
+            refs[ nrefs ].run = files[ i ].header->run;
+            refs[ nrefs ].rec = &files[ i ].records[ r ];
+            nrefs++;
+        }
+    }
+
+    // Group them into episodes
+    qsort(refs, nrefs, sizeof(train_ref_t), train_ref_cmp);
+    check((steps = calloc(nrefs, sizeof(*steps))));
+    check((episodes = calloc(nrefs, sizeof(train_episode_t))));
+    for (size_t i = 0; i < nrefs; i++) {
+        steps[ i ] = refs[ i ].rec;
+        if (i == 0 || !train_same_episode(&refs[ i - 1 ], &refs[ i ])) {
+            episodes[ nepisodes++ ].steps = &steps[ i ];
+        }
+        episodes[ nepisodes - 1 ].len++;
+    }
+
+    // Starting table, from a checkpoint or zero
+    check((table = calloc(1, QMAP_TABLE_SIZE)));
+    if (in_path && ckpt_map(&start, in_path) == 0) {
+        void *init = ckpt_find(&start, CKPT_QMAP, 0, QMAP_TABLE_SIZE);
+        if (init) {
+            memcpy(table, init, QMAP_TABLE_SIZE);
+        }
+        munmap(start.map, start.size);
+    }
+    qmap_attach(&merged, table);
+
+    // Replay the partitions on the workers
+    if ((size_t)workers > nepisodes) {
+        workers = (int)nepisodes;
+    }
+    check((parts = calloc(workers, sizeof(train_part_t))));
+    for (int i = 0; i < workers; i++) {
+        void *copy;
+        check((copy = malloc(QMAP_TABLE_SIZE)));
+        memcpy(copy, table, QMAP_TABLE_SIZE);
+        qmap_attach(&parts[ i ].qm, copy);
+        check((parts[ i ].visits = calloc(QMAP_STATES, sizeof(*parts[ i ].visits))));
+        parts[ i ].episodes = episodes;
+        parts[ i ].nepisodes = nepisodes;
+        parts[ i ].part = i;
+        parts[ i ].nparts = workers;
+        parts[ i ].passes = passes;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    check(sched_init(&sched, workers, workers) != -1);
+    for (int i = 0; i < workers; i++) {
+        check(sched_submit(&sched, i, train_replay, &parts[ i ]) != -1);
+    }
+    sched_wait_idle(&sched);
+    sched_shutdown(&sched);
+    train_merge(&merged, parts, workers);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (int i = 0; i < workers; i++) {
+        updates += parts[ i ].updates;
+    }
+
+    // Every game of nhbot starts from the merged table
+    check((blobs = calloc(ngames, sizeof(ckpt_blob_t))));
+    for (int i = 0; i < ngames; i++) {
+        blobs[ i ] = (ckpt_blob_t){ CKPT_QMAP, i, table, QMAP_TABLE_SIZE };
+    }
+    check(ckpt_save(out_path, blobs, ngames) != -1);
+
+    double elapsed = (double)(t1.tv_sec - t0.tv_sec)
+                   + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "nhbot-train: %zu records, %zu episodes, %d workers, "
+            "%llu updates in %.3f s, wrote %s\n", nrefs, nepisodes, workers,
+            (unsigned long long)updates, elapsed, out_path);
+    return 0;
+
+error:
+    fprintf(stderr, "nhbot-train: failed\n");
+    return 1;
+}
@@ -0,0 +1,331 @@
+#ifndef _TRAJ_H_
+#define _TRAJ_H_
+
+// Binary trajectory log for offline training.
+//
+// Every decision is one fixed-size traj_record_t. The io loop (or any
+// thread) pushes records into a bounded lock-free ring and never blocks;
+// when the ring is full the record is dropped and counted. A logger
+// thread drains the ring into a memory-mapped file and starts a new file
+// once TRAJ_FILE_RECORDS are written.
+//
+// A file is a traj_header_t followed by header.count records. Files of
+// one run share header.run, and a record's episode is identified by
+// (run, game, episode). The reward fields of a record are the change
+// since the previous record of the same episode, i.e. what the previous
+// record's action earned.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "nhbot.h"
+
+#define TRAJ_MAGIC        0x5442484eU  // "NHBT"
+#define TRAJ_VERSION      1
+#define TRAJ_RING_SIZE    (1 << 16)
+#define TRAJ_FILE_RECORDS (1 << 19)
+
+typedef struct {
+    uint32_t game;
+    uint32_t episode;
+    uint64_t step;
+    uint64_t time_ns;
+    NetHackBlStat BlStat;
+    int16_t PlayerRow;
+    int16_t PlayerCol;
+    uint8_t QMap5x5[5*5];
+    uint8_t action;
+    uint8_t reserved[2];
+    int32_t dMoney;
+    int32_t dXp;
+    int32_t dDlvl;
+    int32_t dHP;
+} traj_record_t;
+
+_Static_assert(sizeof(traj_record_t) == 128, "traj_record_t must be 128 bytes");
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t run;
+    uint64_t count;
+    uint64_t created;
+    uint8_t pad[32];
+} traj_header_t;
+
+_Static_assert(sizeof(traj_header_t) == 64, "traj_header_t must be 64 bytes");
+
+typedef struct {
+    uint64_t seq;
+    traj_record_t rec;
+} traj_cell_t;
+
+typedef struct {
+    void *map;
+    size_t size;
+    const traj_header_t *header;
+    const traj_record_t *records;
+} traj_file_t;
+
+typedef struct {
+    traj_cell_t *cells;
+    uint64_t head;
+    uint64_t tail;
+
+    pthread_t thread;
+    bool stop;
+
+    const char *prefix;
+    long started;
+    long pid;
+    uint32_t run;
+    int file_index;
+    uint8_t *map;
+    size_t map_size;
+
+    uint64_t written;
+    uint64_t dropped;
+} traj_log_t;
+
+// Map a log file read-only, -1 if missing or not a trajectory log
+int traj_map(traj_file_t *f, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    *f = (traj_file_t){0};
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(traj_header_t)) {
+        close(fd);
+        return -1;
+    }
+
+    f->size = st.st_size;
+    f->map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (f->map == MAP_FAILED) {
+        f->map = NULL;
+        return -1;
+    }
+
+    f->header = f->map;
+    f->records = (const traj_record_t *)(f->header + 1);
+    if (f->header->magic != TRAJ_MAGIC || f->header->version != TRAJ_VERSION
+     || f->header->record_size != sizeof(traj_record_t)
+     || f->header->count > (f->size - sizeof(traj_header_t))
+                           / sizeof(traj_record_t)) {
+        munmap(f->map, f->size);
+        *f = (traj_file_t){0};
+        return -1;
+    }
+
+    return 0;
+}
+
+// Queue a record, false if the ring is full. Safe from any thread.
+bool traj_push(traj_log_t *log, const traj_record_t *rec)
+{
+    uint64_t pos = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+    traj_cell_t *cell;
+
+    for (;;) {
+        cell = &log->cells[pos & (TRAJ_RING_SIZE - 1)];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t)(seq - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&log->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            __atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+            return false;
+        } else {
+            pos = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->rec = *rec;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Take the oldest record, logger thread only
+static bool traj_pop(traj_log_t *log, traj_record_t *rec)
+{
+    traj_cell_t *cell = &log->cells[log->tail & (TRAJ_RING_SIZE - 1)];
+    uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+
+    if (seq != log->tail + 1) {
+        return false;
+    }
+    *rec = cell->rec;
+    __atomic_store_n(&cell->seq, log->tail + TRAJ_RING_SIZE, __ATOMIC_RELEASE);
+    log->tail++;
+    return true;
+}
+
+// Name of the current file, the pid keeps runs started together apart
+static void traj_path(const traj_log_t *log, char *path, size_t size)
+{
+    snprintf(path, size, "%s.%ld.%ld.%04d.traj", log->prefix,
+             log->started, log->pid, log->file_index);
+}
+
+// Trim the current file to what was written and unmap it
+static void traj_close_file(traj_log_t *log)
+{
+    char path[4096];
+    traj_header_t *h = (traj_header_t *)log->map;
+
+    if (!log->map) {
+        return;
+    }
+    size_t used = sizeof(traj_header_t) + h->count * sizeof(traj_record_t);
+    munmap(log->map, log->map_size);
+    log->map = NULL;
+
+    traj_path(log, path, sizeof(path));
+    if (truncate(path, used) == -1) {
+        fprintf(stderr, "nhbot: could not trim %s\n", path);
+    }
+    log->file_index++;
+}
+
+// Create and map the next file of the log
+static int traj_open_file(traj_log_t *log)
+{
+    char path[4096];
+    traj_header_t *h;
+    int fd = -1;
+
+    log->map_size = sizeof(traj_header_t)
+                  + (size_t)TRAJ_FILE_RECORDS * sizeof(traj_record_t);
+    traj_path(log, path, sizeof(path));
+
+    // Never write over another run's log
+    check((fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) != -1);
+    check(ftruncate(fd, log->map_size) != -1);
+    log->map = mmap(NULL, log->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0);
+    check(log->map != MAP_FAILED);
+    close(fd);
+
+    h = (traj_header_t *)log->map;
+    h->magic = TRAJ_MAGIC;
+    h->version = TRAJ_VERSION;
+    h->record_size = sizeof(traj_record_t);
+    h->run = log->run;
+    h->created = (uint64_t)time(NULL);
+    return 0;
+
+error:
+    if (fd != -1) {
+        close(fd);
+    }
+    log->map = NULL;
+    return -1;
+}
+
+// Drain the ring into the mapped file
+static void *traj_logger(void *p)
+{
+    traj_log_t *log = p;
+    traj_record_t rec;
+    const struct timespec idle = { 0, 1000 * 1000 };
+
+    for (;;) {
+        bool stopping = __atomic_load_n(&log->stop, __ATOMIC_ACQUIRE);
+        int n = 0;
+
+        while (traj_pop(log, &rec)) {
+            if (!log->map && traj_open_file(log) == -1) {
+                __atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            traj_header_t *h = (traj_header_t *)log->map;
+            traj_record_t *records = (traj_record_t *)(log->map + sizeof(*h));
+            records[h->count] = rec;
+            __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+            log->written++;
+            n++;
+            if (h->count == TRAJ_FILE_RECORDS) {
+                traj_close_file(log);
+            }
+        }
+
+        if (stopping) {
+            break;
+        }
+        if (n == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    traj_close_file(log);
+    return NULL;
+}
+
+// Run id of every file of a log, mixed from its start time and pid so
+// that runs started in the same second are told apart
+static uint32_t traj_run_id(long started, long pid)
+{
+    uint64_t x = ((uint64_t)started << 32) ^ (uint64_t)pid;
+
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return (uint32_t)(x >> 32);
+}
+
+// Start logging to prefix.<start time>.<pid>.<n>.traj
+int traj_open(traj_log_t *log, const char *prefix)
+{
+    sigset_t all, old;
+    int err;
+
+    *log = (traj_log_t){ .prefix = prefix, .started = (long)time(NULL),
+                         .pid = (long)getpid() };
+    log->run = traj_run_id(log->started, log->pid);
+
+    check((log->cells = calloc(TRAJ_RING_SIZE, sizeof(traj_cell_t))));
+    for (uint64_t i = 0; i < TRAJ_RING_SIZE; i++) {
+        log->cells[i].seq = i;
+    }
+
+    // The logger inherits a blocked signal mask, signals go to the io loop
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&log->thread, NULL, traj_logger, log);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    check(err == 0);
+    return 0;
+
+error:
+    free(log->cells);
+    log->cells = NULL;
+    return -1;
+}
+
+// Write out what is queued and stop the logger
+void traj_close(traj_log_t *log)
+{
+    __atomic_store_n(&log->stop, true, __ATOMIC_RELEASE);
+    pthread_join(log->thread, NULL);
+    free(log->cells);
+}
+
+#endif
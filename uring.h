@@ -0,0 +1,446 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+// io_uring backend for the game ptys.
+//
+// With select() every loop pass costs a select, a read per game with
+// output, and a select and a write per key. Here each pty master has a
+// multishot read armed once, which fills buffers from a ring registered
+// with the kernel and posts a completion per chunk, and keys are queued
+// as write SQEs, linked so one game's keys land in order. A pass then
+// costs one io_uring_enter() that submits every queued write and waits
+// for output. It is used through raw syscalls, there is no liburing
+// dependency. uring_init() fails on kernels without what it needs
+// (5.19 for buffer rings) and the caller falls back to select(). Without
+// multishot reads (6.7) a plain read is armed again after every chunk.
+// A write that fails or comes up short, and the rest of its link that
+// is then canceled, is finished with write(2) while reaping, in order,
+// so no key is lost.
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "nhbot.h"
+
+#define URING_ENTRIES 4096
+#define URING_BUFS 256
+#define URING_BUF_SIZE 4096
+#define URING_BGID 0
+#define URING_KEY_SLOTS 4096
+#define URING_KEY_SLOT 32
+
+// Newer than some linux/io_uring.h
+#define URING_OP_READ_MULTISHOT 49
+
+// What a completion was for, the top byte of user_data
+#define URING_READ  1ULL
+#define URING_WRITE 2ULL
+#define URING_POLL  3ULL
+
+typedef struct {
+    int fd;
+    bool multishot;
+
+    // Submission ring, sq_tail is ours until uring_enter() publishes it
+    unsigned *sq_head;
+    unsigned *sq_ktail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_tail;
+    unsigned sq_submitted;
+    struct io_uring_sqe *sqes;
+
+    // Completion ring
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+
+    // Read buffers handed to the kernel
+    struct io_uring_buf_ring *buf_ring;
+    uint8_t *bufs;
+    uint16_t buf_tail;
+
+    // Key buffers of queued writes, free while not in flight
+    uint8_t keys[ URING_KEY_SLOTS ][ URING_KEY_SLOT ];
+    uint8_t key_len[ URING_KEY_SLOTS ];
+    int key_fd[ URING_KEY_SLOTS ];
+    uint16_t key_free[ URING_KEY_SLOTS ];
+    int nkey_free;
+    struct io_uring_sqe *last_write;
+    int last_write_fd;
+
+    // Fds with a read armed
+    uint8_t *armed;
+    int narmed;
+
+    uint64_t enters;
+    uint64_t write_retries;
+    uint64_t write_errors;
+} uring_t;
+
+static inline int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int uring_register(int fd, unsigned op, void *arg, unsigned n)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+// Map part of the ring fd, NULL on failure
+static void *uring_map(int fd, size_t len, off_t off)
+{
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, off);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Give read buffer bid back to the kernel
+static inline void uring_buf_give(uring_t *u, uint16_t bid)
+{
+    // bufs[ 0 ].resv is the ring tail, only the other fields are written
+    struct io_uring_buf *b = &u->buf_ring->bufs[ u->buf_tail & (URING_BUFS - 1) ];
+
+    b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    u->buf_tail++;
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Does the kernel know opcode op
+static bool uring_supports(int fd, int op)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    bool supported = false;
+
+    if (probe && uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        supported = op <= probe->last_op
+                 && (probe->ops[ op ].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+void uring_free(uring_t *u)
+{
+    if (u->buf_ring) {
+        munmap(u->buf_ring, URING_BUFS * sizeof(struct io_uring_buf));
+    }
+    if (u->sqes) {
+        munmap(u->sqes, u->sqes_len);
+    }
+    if (u->cq_ring && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_len);
+    }
+    if (u->sq_ring) {
+        munmap(u->sq_ring, u->sq_ring_len);
+    }
+    if (u->fd != -1) {
+        close(u->fd);
+    }
+    free(u->bufs);
+    free(u->armed);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+// Set up the rings and read buffers, -1 if this kernel cannot
+int uring_init(uring_t *u)
+{
+    struct io_uring_params p = {
+        .flags = IORING_SETUP_CQSIZE,
+        .cq_entries = URING_ENTRIES * 4,
+    };
+    struct io_uring_buf_reg reg = {0};
+    uint8_t *sq;
+    uint8_t *cq;
+    void *ring;
+
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+    check((u->fd = uring_setup(URING_ENTRIES, &p)) != -1);
+    // Waiting with a timeout needs EXT_ARG
+    check(p.features & IORING_FEAT_EXT_ARG);
+
+    u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP && u->cq_ring_len > u->sq_ring_len) {
+        u->sq_ring_len = u->cq_ring_len;
+    }
+    check((u->sq_ring = uring_map(u->fd, u->sq_ring_len, IORING_OFF_SQ_RING)));
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        check((u->cq_ring = uring_map(u->fd, u->cq_ring_len, IORING_OFF_CQ_RING)));
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    check((u->sqes = uring_map(u->fd, u->sqes_len, IORING_OFF_SQES)));
+
+    sq = u->sq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_ktail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->sq_tail = u->sq_submitted = *u->sq_ktail;
+    cq = u->cq_ring;
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // Register the read buffer ring, the kernel picks a buffer per read
+    ring = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    check(ring != MAP_FAILED);
+    u->buf_ring = ring;
+    check((u->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE)));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    check(uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0);
+    for (int bid = 0; bid < URING_BUFS; bid++) {
+        uring_buf_give(u, bid);
+    }
+
+    for (int i = 0; i < URING_KEY_SLOTS; i++) {
+        u->key_free[ i ] = URING_KEY_SLOTS - 1 - i;
+    }
+    u->nkey_free = URING_KEY_SLOTS;
+    u->last_write_fd = -1;
+    u->multishot = uring_supports(u->fd, URING_OP_READ_MULTISHOT);
+    errno = 0;
+    return 0;
+
+error:
+    uring_free(u);
+    return -1;
+}
+
+// A cleared SQE to fill in, NULL if the ring is full until the next enter
+static struct io_uring_sqe *uring_sqe(uring_t *u)
+{
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    unsigned i;
+
+    if (u->sq_tail - head >= u->sq_entries) {
+        return NULL;
+    }
+    i = u->sq_tail++ & *u->sq_mask;
+    memset(&u->sqes[ i ], 0, sizeof(struct io_uring_sqe));
+    u->sq_array[ i ] = i;
+    return &u->sqes[ i ];
+}
+
+// Publish the queued SQEs and enter the kernel, waiting for a
+// completion up to timeout_ns if wait is set. 1 if the wait timed out
+// or a signal came in.
+static int uring_enter(uring_t *u, bool wait, uint64_t timeout_ns)
+{
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ns / 1000000000ULL,
+        .tv_nsec = timeout_ns % 1000000000ULL,
+    };
+    struct io_uring_getevents_arg arg = { .ts = (uint64_t)(uintptr_t)&ts };
+    unsigned submit = u->sq_tail - u->sq_submitted;
+    int n;
+
+    __atomic_store_n(u->sq_ktail, u->sq_tail, __ATOMIC_RELEASE);
+    u->last_write = NULL;
+    u->last_write_fd = -1;
+    u->enters++;
+    n = (int)syscall(__NR_io_uring_enter, u->fd, submit, wait ? 1 : 0,
+                     IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0),
+                     &arg, sizeof(arg));
+    if (n >= 0) {
+        u->sq_submitted += n;
+        return 0;
+    }
+    // Timed out or interrupted, the SQEs were still consumed
+    u->sq_submitted = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    return errno == ETIME || errno == EINTR ? 1 : -1;
+}
+
+// An SQE for a request to arm on fd, NULL if one is armed already or
+// there is no room
+static struct io_uring_sqe *uring_arm(uring_t *u, int fd)
+{
+    struct io_uring_sqe *sqe;
+
+    if (fd >= u->narmed) {
+        int n = fd + 64;
+        uint8_t *armed = realloc(u->armed, n);
+        if (!armed) {
+            return NULL;
+        }
+        memset(armed + u->narmed, 0, n - u->narmed);
+        u->armed = armed;
+        u->narmed = n;
+    }
+    if (u->armed[ fd ] || !(sqe = uring_sqe(u))) {
+        return NULL;
+    }
+    u->armed[ fd ] = 1;
+    return sqe;
+}
+
+// Keep fd polled for input, uring_reap() reports it without data
+void uring_poll(uring_t *u, int fd)
+{
+    struct io_uring_sqe *sqe = uring_arm(u, fd);
+
+    if (sqe) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = URING_POLL << 56 | (uint32_t)fd;
+    }
+}
+
+// Keep a read armed on fd, output arrives through uring_reap()
+void uring_read(uring_t *u, int fd)
+{
+    struct io_uring_sqe *sqe = uring_arm(u, fd);
+
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = u->multishot ? URING_OP_READ_MULTISHOT : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->len = u->multishot ? 0 : URING_BUF_SIZE;
+    sqe->user_data = URING_READ << 56 | (uint32_t)fd;
+}
+
+// Queue len bytes for fd, after the writes to fd already queued. The
+// bytes are copied. Returns len, or -1 if there is no room, in which
+// case the queue was submitted and the caller should write(2) itself.
+ssize_t uring_write(uring_t *u, int fd, const uint8_t *buf, size_t len)
+{
+    for (size_t done = 0; done < len; done += URING_KEY_SLOT) {
+        size_t n = len - done < URING_KEY_SLOT ? len - done : URING_KEY_SLOT;
+        struct io_uring_sqe *sqe;
+        uint16_t slot;
+
+        if (u->nkey_free == 0 || !(sqe = uring_sqe(u))) {
+            uring_enter(u, false, 0);
+            return -1;
+        }
+        // Link after the last write to the same fd in this submission
+        if (u->last_write && u->last_write_fd == fd) {
+            u->last_write->flags |= IOSQE_IO_LINK;
+        }
+        slot = u->key_free[ --u->nkey_free ];
+        memcpy(u->keys[ slot ], buf + done, n);
+        u->key_len[ slot ] = (uint8_t)n;
+        u->key_fd[ slot ] = fd;
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)u->keys[ slot ];
+        sqe->len = n;
+        sqe->off = 0;
+        sqe->user_data = URING_WRITE << 56 | slot;
+        u->last_write = sqe;
+        u->last_write_fd = fd;
+    }
+    return len;
+}
+
+// Submit everything queued and wait up to timeout_ns for a completion,
+// 1 if none came
+int uring_wait(uring_t *u, uint64_t timeout_ns)
+{
+    return uring_enter(u, true, timeout_ns);
+}
+
+// Write what a failed write SQE left of its keys, waiting up to 100 ms
+// at a time for the non-blocking pty to take them. -1 if it never does.
+static int uring_write_rest(uring_t *u, int fd, const uint8_t *buf, size_t len)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+    u->write_retries++;
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n > 0) {
+            buf += n;
+            len -= (size_t)n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && errno == EAGAIN) {
+            if (poll(&pfd, 1, 100) != 1) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Handle every completion, calling on_read(arg, fd, data, n) for output
+// and with n 0 for a polled fd. A read or poll that ended is armed again
+// on the next uring_read() or uring_poll(). Returns the number of reads
+// and polls, finished writes are not counted.
+int uring_reap(uring_t *u, void (*on_read)(void *, int, const uint8_t *, size_t),
+                void *arg)
+{
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    int events = 0;
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &u->cqes[ head & *u->cq_mask ];
+        uint64_t kind = cqe->user_data >> 56;
+        uint32_t id = (uint32_t)cqe->user_data;
+
+        if (kind == URING_WRITE) {
+            size_t done = cqe->res > 0 ? (size_t)cqe->res : 0;
+            if (done < u->key_len[ id ]
+             && uring_write_rest(u, u->key_fd[ id ], u->keys[ id ] + done,
+                                 u->key_len[ id ] - done) == -1) {
+                u->write_errors++;
+            }
+            u->key_free[ u->nkey_free++ ] = (uint16_t)id;
+            continue;
+        }
+
+        events++;
+        if (kind == URING_POLL && cqe->res > 0) {
+            on_read(arg, (int)id, NULL, 0);
+        }
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe->res > 0) {
+                on_read(arg, (int)id, u->bufs + (size_t)bid * URING_BUF_SIZE,
+                        (size_t)cqe->res);
+            }
+            uring_buf_give(u, bid);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE) && (int)id < u->narmed) {
+            u->armed[ id ] = 0;
+        }
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return events;
+}
+
+#endif